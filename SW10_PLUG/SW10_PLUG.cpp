@@ -1,12 +1,37 @@
 #include "SW10_PLUG.h"
 #include "IPlug_include_in_plug_src.h"
 #include <sstream>
+#include <mutex>
+#include <thread>
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Mapping hints for the shared ROM: fault all pages in up front, and ask for
+// transparent huge pages (Linux only, needs a filesystem that supports them).
+#ifndef ROM_MAP_POPULATE
+#define ROM_MAP_POPULATE 1
+#endif
+#ifndef ROM_MAP_HUGEPAGES
+#define ROM_MAP_HUGEPAGES 0
+#endif
 
 static struct timespec start_time;
 
 static const char* arg_rom = "ROMSXGM.BIN";
+static const char* arg_cache_dir = "SW10_PLUG";
+static const char* arg_cache = "SW10_PLUG.cache";
 static uint32_t outbuf_counter;
-static uint8_t* rom_address;
+
+// One read-only mapping of the ROM per process, shared by all instances.
+static std::mutex rom_mutex;
+static const uint8_t* rom_address;
+static int rom_refcount;
 
 
 static uint32_t lsgGetTime()
@@ -29,11 +54,12 @@ SW10_PLUG::SW10_PLUG(const InstanceInfo& info)
   bufferMode(1),
   wav_buffer(std::make_unique<uint8_t[]>(262144)) // 256KB buffer, ok for 88200Hz?
 {
-  start_synth();
+  // The ROM and the engine are only loaded on the first OnReset, so hosts that
+  // just scan or instantiate the plugin don't pay for it.
 
   // TODO remap params
   GetParam(kParamSampleRate)->InitEnum("SampleRate", frequency, { "11025", "22050", "44100", "16538", "48000" });
-  GetParam(kParamPolyphony)->InitEnum("Polyphony", polyphony, {"24", "32", "48", "64", "128", "256"});
+  GetParam(kParamPolyphony)->InitEnum("Polyphony", polyphony, {"24", "32", "48", "64", "128", "256", "512", "1024", "2048", "4096"});
   GetParam(kParamReverbMode)->InitEnum("Reverb Mode", reverb_effect, { "Off", "Reverb 1", "Reverb 2" });
   GetParam(kParamPitchBendRange)->InitInt("P.Bend Rng", 2, 0, 127, "semitones", IParam::kFlagsNone, "ADSR");
   GetParam(kParamVelocityFunction)->InitInt("Velocity Curve", 6, 0, 11, "", IParam::kFlagsNone, "ADSR");
@@ -41,6 +67,10 @@ SW10_PLUG::SW10_PLUG(const InstanceInfo& info)
   //GetParam(kParamSustain)->InitDouble("Sustain", 50., 0., 100., 1, "%", IParam::kFlagsNone, "ADSR");
   //GetParam(kParamRelease)->InitDouble("Release", 10., 2., 1000., 0.1, "ms", IParam::kFlagsNone, "ADSR");
   GetParam(kParamBufferRenderMode)->InitEnum("Render Mode", 1, {"Off", "Low Latency", "Original Driver"});
+  GetParam(kParamReverbThread)->InitBool("Reverb Thread", false);
+  GetParam(kParamVoiceThreads)->InitInt("Voice Threads", 0, 0, MAX_VOICE_THREADS, "threads");
+  GetParam(kParamThinMidi)->InitBool("Thin Dense MIDI", false);
+  GetParam(kParamStackNotes)->InitBool("Stack Duplicate Notes", false);
   //GetParam(kParamLFORateHz)->InitFrequency("LFO Rate", 1., 0.01, 40.);
   //GetParam(kParamLFORateTempo)->InitEnum("LFO Rate", LFO<>::k1, {LFO_TEMPODIV_VALIST});
   //GetParam(kParamLFORateMode)->InitBool("LFO Sync", true);
@@ -82,6 +112,7 @@ SW10_PLUG::SW10_PLUG(const InstanceInfo& info)
     pGraphics->AttachControl(new IVSliderControl(sliders.GetGridCell(1, 1, 4), kParamVelocityFunction, "Vel. Curve"));
     polyIndicator = new ITextControl(sliders.GetGridCell(2, 1, 4), "Cur. Poly");  // Framework will deallocate for us.
     pGraphics->AttachControl(polyIndicator); 
+    pGraphics->AttachControl(new IVToggleControl(sliders.GetGridCell(3, 1, 4), kParamReverbThread, "Reverb Thread"));
 
     pGraphics->AttachControl(new IVLEDMeterControl<2>(b.GetFromRight(100).GetPadded(-5).GetReducedFromBottom(100)), kCtrlTagMeter);
 
@@ -109,8 +140,13 @@ SW10_PLUG::SW10_PLUG(const InstanceInfo& info)
 #endif
 }
 
+SW10_PLUG::~SW10_PLUG()
+{
+  stop_synth();
+}
 
 char* SW10_PLUG::handleDllPath(const char* romname) {
+#if defined(_WIN32)
   static char path[MAX_PATH] = "";
   HMODULE hm = nullptr;
 
@@ -128,103 +164,316 @@ char* SW10_PLUG::handleDllPath(const char* romname) {
     fprintf(stderr, "GetModuleFileName failed, error = %d\n", ret);
     return path;
   }
+#else
+  static char path[PATH_MAX] = "";
+  Dl_info info;
+
+  if (dladdr((void*)&lsgGetTime, &info) == 0 || info.dli_fname == nullptr)
+  {
+    fprintf(stderr, "dladdr failed\n");
+    return path;
+  }
+  snprintf(path, sizeof(path), "%s", info.dli_fname);
+#endif
 
   // The path variable should now contain the full filepath for this DLL.
   std::string s1(path);
   std::stringstream ss;
 
-  ss << s1.substr(0, s1.find_last_of("\\/")) << "\\";
-  strcpy(path, ss.str().c_str());
-  strcat(path, romname);
+  ss << s1.substr(0, s1.find_last_of("\\/") + 1);
+  snprintf(path, sizeof(path), "%s%s", ss.str().c_str(), romname);
   return path;
 }
 
-uint8_t* SW10_PLUG::load_rom_file(const char* romname)
+// Maps the ROM file read-only, or returns nullptr if it can't be opened or is
+// not exactly ROM_SIZE bytes.
+static const uint8_t* map_rom_file(const char* filename)
 {
-  FILE* f;
-  uint8_t* mem;
+#if defined(_WIN32)
+  HANDLE file;
+  HANDLE mapping;
+  LARGE_INTEGER size;
+  void* mem;
+
+  file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return nullptr;
 
-  // Open in same dir as DLL
-  char* dirPath = handleDllPath(romname);
-  f = fopen(dirPath, "rb");
-  if (f == nullptr)
+  if (!GetFileSizeEx(file, &size) || size.QuadPart != ROM_SIZE)
   {
-    //Fallback - open in current process CWD
-    if (f = fopen(romname, "rb"))
-      return nullptr;
+    CloseHandle(file);
+    return nullptr;
   }
 
-  // Original ROM always 2MB. If using custom ROM, this may need to change.
-  mem = (uint8_t*)malloc(2 * 1024 * 1024);
+  // The view keeps the mapping and the file open until UnmapViewOfFile.
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr)
+    return nullptr;
+  mem = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, ROM_SIZE);
+  CloseHandle(mapping);
   if (mem == nullptr)
-  {
-    fclose(f);
     return nullptr;
+
+#if ROM_MAP_POPULATE
+  // Large pages can't back file views, but the pages can be read in at once.
+  // Looked up at runtime, PrefetchVirtualMemory is missing before Windows 8.
+  typedef BOOL (WINAPI *PrefetchVirtualMemoryFunc)(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+  PrefetchVirtualMemoryFunc prefetch = (PrefetchVirtualMemoryFunc)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+  if (prefetch != nullptr)
+  {
+    WIN32_MEMORY_RANGE_ENTRY range = { mem, ROM_SIZE };
+    prefetch(GetCurrentProcess(), 1, &range, 0);
   }
+#endif
+
+  return (const uint8_t*)mem;
+#else
+  struct stat st;
+  int fd;
+  int flags;
+  void* mem;
 
-  // If ROM read was not exactly 2MB, fail loading.
-  if (fread(mem, 1, 2 * 1024 * 1024, f) != 2 * 1024 * 1024)
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  if (fstat(fd, &st) != 0 || st.st_size != ROM_SIZE)
   {
-    free(mem);
-    fclose(f);
+    close(fd);
     return nullptr;
   }
 
-  return mem;
+  flags = MAP_SHARED;
+#if ROM_MAP_POPULATE && defined(MAP_POPULATE)
+  flags |= MAP_POPULATE;
+#endif
+  mem = mmap(nullptr, ROM_SIZE, PROT_READ, flags, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return nullptr;
+
+#if ROM_MAP_HUGEPAGES && defined(MADV_HUGEPAGE)
+  madvise(mem, ROM_SIZE, MADV_HUGEPAGE);
+#endif
+#if ROM_MAP_POPULATE && !defined(MAP_POPULATE)
+  posix_madvise(mem, ROM_SIZE, POSIX_MADV_WILLNEED);
+#endif
+
+  return (const uint8_t*)mem;
+#endif
 }
 
-void SW10_PLUG::lsgWrite(uint8_t* event, unsigned int length, int offset)
+static void unmap_rom_file(const uint8_t* mem)
 {
-  const uint32_t time = lsgGetTime();
-  const uint8_t* p = reinterpret_cast<const BYTE*>(event);
+#if defined(_WIN32)
+  UnmapViewOfFile(mem);
+#else
+  munmap((void*)mem, ROM_SIZE);
+#endif
+}
 
-  // Old method
-  for (; length > 0; length--, p++) {
-    vlsgInstance->VLSG_Write(&time, 4);
-    vlsgInstance->VLSG_Write(p, 1);
+// The wave cache file goes to a directory of its own in the user's cache
+// directory, shared by every process of that user but out of reach of other
+// users, who could otherwise plant or truncate the file the engine maps.
+// Returns nullptr, which turns the cache file off, if there is none.
+static const char* get_cache_path(const char* dirname, const char* cachename)
+{
+#if defined(_WIN32)
+  static char path[MAX_PATH] = "";
+  char base[MAX_PATH];
+  DWORD length = GetEnvironmentVariableA("LOCALAPPDATA", base, sizeof(base));
+
+  if (length == 0 || length >= sizeof(base))
+    return nullptr;
+  if (snprintf(path, sizeof(path), "%s\\%s", base, dirname) >= (int)sizeof(path))
+    return nullptr;
+  if (!CreateDirectoryA(path, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+    return nullptr;
+  if (snprintf(path, sizeof(path), "%s\\%s\\%s", base, dirname, cachename) >= (int)sizeof(path))
+    return nullptr;
+#else
+  static char path[PATH_MAX] = "";
+  char base[PATH_MAX];
+  const char* dir = getenv("XDG_CACHE_HOME");
+  struct stat st;
+
+  if (dir != nullptr && dir[0] == '/') {
+    if (snprintf(base, sizeof(base), "%s", dir) >= (int)sizeof(base))
+      return nullptr;
+  } else {
+    dir = getenv("HOME");
+    if (dir == nullptr || dir[0] != '/')
+      return nullptr;
+    if (snprintf(base, sizeof(base), "%s/.cache", dir) >= (int)sizeof(base))
+      return nullptr;
+    mkdir(base, 0700);
   }
+  if (snprintf(path, sizeof(path), "%s/%s", base, dirname) >= (int)sizeof(path))
+    return nullptr;
+  mkdir(path, 0700);
+  // Only use a directory that is ours and that no one else can write to
+  if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    return nullptr;
+  if (snprintf(path, sizeof(path), "%s/%s/%s", base, dirname, cachename) >= (int)sizeof(path))
+    return nullptr;
+#endif
+  return path;
+}
+
+// Takes a reference on the shared ROM, mapping it on first use.
+const uint8_t* SW10_PLUG::load_rom_file(const char* romname)
+{
+  std::lock_guard<std::mutex> lock(rom_mutex);
+
+  if (rom_refcount == 0)
+  {
+    // Open in same dir as DLL
+    rom_address = map_rom_file(handleDllPath(romname));
+    if (rom_address == nullptr)
+    {
+      //Fallback - open in current process CWD
+      rom_address = map_rom_file(romname);
+      if (rom_address == nullptr)
+        return nullptr;
+    }
+  }
+
+  rom_refcount++;
+  return rom_address;
+}
+
+// Drops a reference taken by load_rom_file, the last one unmaps the ROM.
+void SW10_PLUG::unload_rom_file(void)
+{
+  std::lock_guard<std::mutex> lock(rom_mutex);
+
+  rom_refcount--;
+  if (rom_refcount == 0)
+  {
+    unmap_rom_file(rom_address);
+    rom_address = nullptr;
+  }
+}
+
+void SW10_PLUG::lsgWrite(uint8_t* event, unsigned int length, int offset)
+{
+  engine_users++;
+  if (!synth_started) {
+    engine_users--;
+    return;
+  }
+
+  // The engine's event ring takes a single writer, so this only runs on the audio thread
+  vlsgInstance->VLSG_PostMidi(event, length, offset);
   vlsgInstance->ProcessMidiData();
+  engine_users--;
+}
+
+void SW10_PLUG::send_bend_range(uint8_t bendRange)
+{
+  // Send 0-0-bendRange RPN event
+  uint8_t data[3];
+  data[0] = 0xB0 | 0;
+  data[1] = 100 & 0x7f;
+  data[2] = 0 & 0x7f;
+  lsgWrite(data, 3);
+
+  data[0] = 0xB0 | 0;
+  data[1] = 101 & 0x7f;
+  data[2] = 0 & 0x7f;
+  lsgWrite(data, 3);
+
+  data[0] = 0xB0 | 0;
+  data[1] = 6 & 0x7f;
+  data[2] = bendRange & 0x7f;
+  lsgWrite(data, 3);
 }
 
 int SW10_PLUG::start_synth(void)
 {
-  rom_address = load_rom_file(arg_rom);
-  if (rom_address == NULL) {
+  rom_data = load_rom_file(arg_rom);
+  if (rom_data == nullptr) {
     fprintf(stderr, "Error opening ROM file: %s\n", arg_rom);
     return -1;
   }
 
-  // set function GetTime
+  // set function GetTime, but count time in rendered samples so that offline
+  // renders come out the same as real time ones
   vlsgInstance->VLSG_SetFunc_GetTime(lsgGetTime);
+  vlsgInstance->VLSG_SetParameter(PARAMETER_TimeSource, TIMESRC_Samples);
 
   // set frequency
   vlsgInstance->VLSG_SetParameter(PARAMETER_Frequency, frequency);
 
-  // set polyphony
+  // set polyphony, with voices allocated for it alone; OnIdle grows the pool if it is raised
+  vlsgInstance->VLSG_SetParameter(PARAMETER_VoicePool, 0);
   vlsgInstance->VLSG_SetParameter(PARAMETER_Polyphony, 0x10 + polyphony);
 
   // set reverb effect
   vlsgInstance->VLSG_SetParameter(PARAMETER_Effect, 0x20 + reverb_effect);
 
   // set address of ROM file
-  vlsgInstance->VLSG_SetParameter(PARAMETER_ROMAddress, (uintptr_t)rom_address);
+  vlsgInstance->VLSG_SetParameter(PARAMETER_ROMAddress, (uintptr_t)rom_data);
+
+  // set wave cache file, so VLSG_PlaybackStart can map the decoded ROM tables
+  vlsgInstance->VLSG_SetParameter(PARAMETER_CacheFile, (uintptr_t)get_cache_path(arg_cache_dir, arg_cache));
 
   // set output buffer
   outbuf_counter = 0;
   memset(wav_buffer.get(), 0, 262144);
   vlsgInstance->VLSG_SetParameter(PARAMETER_OutputBuffer, (uintptr_t)wav_buffer.get());
 
-  // start playback
-  vlsgInstance->VLSG_PlaybackStart();
+  // start playback; the voice pool or wave cache can fail to allocate, retried on the next OnReset
+  if (!vlsgInstance->VLSG_PlaybackStart()) {
+    fprintf(stderr, "Error starting the synth\n");
+    unload_rom_file();
+    rom_data = nullptr;
+    return -1;
+  }
+  synth_started = true;
+
+  // Sent as MIDI by the next ProcessBlock
+  OnParamChange(kParamPitchBendRange);
 
   return 0;
 }
 
+// Makes room for polyphony raised above the voice pool by the knob or SysEx,
+// keeping the notes that play. The audio thread outputs silence while the
+// voice arrays are copied, and queues MIDI for the block after.
+void SW10_PLUG::grow_voice_pool(void)
+{
+  const int32_t poly = vlsgInstance->VLSG_GetPolyphony();
+
+  if (voice_pool_failed != 0 && poly >= voice_pool_failed)
+    return;
+
+  voice_pool_growing = true;
+  synth_started = false;
+  while (engine_users != 0)
+    std::this_thread::yield();
+
+  if (!vlsgInstance->VLSG_ResizeVoicePool(poly)) {
+    fprintf(stderr, "Error growing the voice pool to %d voices\n", poly);
+    voice_pool_failed = poly;
+  }
+
+  synth_started = true;
+  voice_pool_growing = false;
+}
+
 void SW10_PLUG::stop_synth(void)
 {
   polyIndicator = nullptr;
+  if (!synth_started)
+    return;
+  synth_started = false;
   vlsgInstance->VLSG_PlaybackStop();
-  //munmap(rom_address, ROMSIZE); // TODO unload
+  if (rom_data != nullptr) {
+    unload_rom_file();
+    rom_data = nullptr;
+  }
 }
 
 void SW10_PLUG::ProcessBlock(sample** inputs, sample** outputs, int nFrames)
@@ -234,11 +483,26 @@ void SW10_PLUG::ProcessBlock(sample** inputs, sample** outputs, int nFrames)
   static char polyBuf[4] = "%d";
   int32_t poly;
 
+  // Held off by grow_voice_pool, which waits for engine_users to drop to 0
+  engine_users++;
+  if (!synth_started) {
+    engine_users--;
+    for (int frameIdx = 0; frameIdx < nFrames; frameIdx++) {
+      outputs[0][frameIdx] = 0.;
+      outputs[1][frameIdx] = 0.;
+    }
+    return;
+  }
+
+  const int bendRange = pending_bend_range.exchange(-1);
+  if (bendRange >= 0)
+    send_bend_range((uint8_t)bendRange);
+
   if (bufferMode == 1) {
     // Attempt 1 - directly render as requested to output buffer (without respecting internal timer code)
     poly = vlsgInstance->VLSG_BufferVst(outbuf_counter, outputs, nFrames, mMidiQueue, mSysExQueue);
     if (polyIndicator != nullptr)
-      polyIndicator->SetStrFmt(4, polyBuf, poly);
+      polyIndicator->SetStrFmt(5, polyBuf, poly);
     mMidiQueue.Flush(nFrames);
     mSysExQueue.Flush(nFrames);
   } else if (bufferMode == 2) {
@@ -253,7 +517,7 @@ void SW10_PLUG::ProcessBlock(sample** inputs, sample** outputs, int nFrames)
       if (renderedSampleQueueSize <= 0) {
         poly = vlsgInstance->VLSG_Buffer(outbuf_counter);
         if (polyIndicator != nullptr) 
-          polyIndicator->SetStrFmt(4, "%d", poly);
+          polyIndicator->SetStrFmt(5, "%d", poly);
         renderedSampleQueueSize += 1024;
         ++outbuf_counter;
       }
@@ -262,6 +526,7 @@ void SW10_PLUG::ProcessBlock(sample** inputs, sample** outputs, int nFrames)
       --renderedSampleQueueSize;
     }
   }
+  engine_users--;
   
   mMeterSender.ProcessBlock(outputs, nFrames, kCtrlTagMeter);
 }
@@ -269,14 +534,23 @@ void SW10_PLUG::ProcessBlock(sample** inputs, sample** outputs, int nFrames)
 void SW10_PLUG::OnIdle()
 {
   mMeterSender.TransmitData(*this);
+
+  // Off the audio thread, so the voice pool can be reallocated here
+  if (synth_started && vlsgInstance->VLSG_GetPolyphony() > vlsgInstance->VLSG_GetVoicePool())
+    grow_voice_pool();
 }
 
 void SW10_PLUG::OnReset()
 {
   // TODO reset VLSG synth state
   mMeterSender.Reset(GetSampleRate());
-  mMidiQueue.Resize(GetBlockSize());
+  // Room for a block of very dense MIDI, so ProcessMidiMsg does not grow it on the audio thread
+  mMidiQueue.Resize(GetBlockSize() > MIDI_BATCH_SIZE ? GetBlockSize() : MIDI_BATCH_SIZE);
   mSysExQueue.Resize(GetBlockSize());
+
+  // First activation, see the constructor. Retried on the next one if the ROM is missing.
+  if (!synth_started && !voice_pool_growing)
+    start_synth();
 }
 
 void SW10_PLUG::ProcessSysEx(const ISysEx& msg)
@@ -286,6 +560,10 @@ void SW10_PLUG::ProcessSysEx(const ISysEx& msg)
   int length = msg.mSize;
   uint8_t *data = (uint8_t*)(msg.mData);
 
+  // Queued while grow_voice_pool holds the engine, see ProcessBlock
+  if (!synth_started && !voice_pool_growing)
+    return;
+
   if (bufferMode == 1) {
     mSysExQueue.Add(msg);
   } else {
@@ -305,6 +583,9 @@ void SW10_PLUG::ProcessMidiMsg(const IMidiMsg& msg)
 {
   TRACE;
 
+  if (!synth_started && !voice_pool_growing)
+    return;
+
   // Only for low latency mode
   if (bufferMode == 1) {
     mMidiQueue.Add(msg);
@@ -447,33 +728,36 @@ void SW10_PLUG::OnParamChange(int paramIdx)
       break;
     case kParamBufferRenderMode:
       bufferMode = value;
+      SetLatency(bufferMode == 1 ? vlsgInstance->VLSG_GetLatency() : 0);
       break;
     case kParamReverbMode:
       reverb_effect = value;
       vlsgInstance->VLSG_SetParameter(PARAMETER_Effect, 0x20 + reverb_effect);
       break;
-    case kParamPitchBendRange: {
-      // Send 0-0-bendRange RPN event
-      uint8_t data[3];
-      data[0] = 0xB0 | 0;
-      data[1] = 100 & 0x7f;
-      data[2] = 0 & 0x7f;
-      lsgWrite(data, 3);
-
-      data[0] = 0xB0 | 0;
-      data[1] = 101 & 0x7f;
-      data[2] = 0 & 0x7f;
-      lsgWrite(data, 3);
-
-      data[0] = 0xB0 | 0;
-      data[1] = 6 & 0x7f;
-      data[2] = (uint8_t)value & 0x7f;
-      lsgWrite(data, 3);
+    case kParamPitchBendRange:
+      // May be the UI thread, ProcessBlock sends it
+      pending_bend_range = (int)value & 0x7f;
       break;
-    }
     case kParamVelocityFunction:
       vlsgInstance->VLSG_SetParameter(PARAMETER_VelocityFunc, 0x40 + value);
       break;
+    case kParamReverbThread:
+      // Only used by the low latency mode, which then runs behind by VLSG_GetLatency() frames
+      vlsgInstance->VLSG_SetParameter(PARAMETER_ReverbPipeline, value != 0);
+      SetLatency(bufferMode == 1 ? vlsgInstance->VLSG_GetLatency() : 0);
+      break;
+    case kParamVoiceThreads:
+      // Extra threads next to the audio thread, 0 mixes every voice on the audio thread
+      vlsgInstance->VLSG_SetParameter(PARAMETER_VoiceThreads, value);
+      break;
+    case kParamThinMidi:
+      // Low latency mode only; also drops notes released within one control period and stacked duplicates
+      vlsgInstance->VLSG_SetParameter(PARAMETER_MidiBatch, MIDIBATCH_MergeControllers | (value != 0 ? MIDIBATCH_CancelNotes : 0));
+      break;
+    case kParamStackNotes:
+      // Identical notes started within one control period play on one voice until released
+      vlsgInstance->VLSG_SetParameter(PARAMETER_VoiceStacking, value != 0);
+      break;
   }
 }
 
@@ -496,22 +780,8 @@ bool SW10_PLUG::OnMessage(int msgTag, int ctrlTag, int dataSize, const void* pDa
   {
     auto bendRange = *static_cast<const uint8_t*>(pData);
 
-    // Send 0-0-bendRange RPN event
-    uint8_t data[3];
-    data[0] = 0xB0 | 0;
-    data[1] = 100 & 0x7f;
-    data[2] = 0 & 0x7f;
-    lsgWrite(data, 3);
-
-    data[0] = 0xB0 | 0;
-    data[1] = 101 & 0x7f;
-    data[2] = 0 & 0x7f;
-    lsgWrite(data, 3);
-
-    data[0] = 0xB0 | 0;
-    data[1] = 6 & 0x7f;
-    data[2] = bendRange & 0x7f;
-    lsgWrite(data, 3);
+    // UI thread, ProcessBlock sends it
+    pending_bend_range = bendRange & 0x7f;
   }
   
   return false;
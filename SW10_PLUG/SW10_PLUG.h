@@ -6,6 +6,7 @@
 
 const int kNumPresets = 1;
 
+#if defined(_WIN32)
 int clock_gettime(int, struct timespec* spec)      //C-file part
 {
   __int64 wintime; GetSystemTimeAsFileTime((FILETIME*)&wintime);
@@ -14,6 +15,7 @@ int clock_gettime(int, struct timespec* spec)      //C-file part
   spec->tv_nsec = wintime % 10000000i64 * 100;      //nano-seconds
   return 0;
 }
+#endif
 
 
 enum EParams
@@ -30,6 +32,10 @@ enum EParams
   kParamLFORateTempo,
   kParamLFORateMode,
   kParamLFODepth,
+  kParamReverbThread,
+  kParamVoiceThreads,
+  kParamThinMidi,
+  kParamStackNotes,
   kNumParams
 };
 
@@ -51,6 +57,7 @@ class SW10_PLUG final : public Plugin
 {
 public:
   SW10_PLUG(const InstanceInfo& info);
+  ~SW10_PLUG();
 
 public:
   void ProcessBlock(sample** inputs, sample** outputs, int nFrames) override;
@@ -75,10 +82,19 @@ private:
   int reverb_effect = 0;
   //std::unique_ptr<ITextControl> polyIndicator;
   ITextControl* polyIndicator = nullptr;
+  const uint8_t* rom_data = nullptr; // reference on the shared ROM, see load_rom_file
+  std::atomic<bool> synth_started{false}; // set once start_synth has run, see OnReset
+  std::atomic<int> pending_bend_range{-1}; // pitch bend range for ProcessBlock to send, or -1
+  std::atomic<int> engine_users{0}; // audio thread calls inside vlsgInstance, see grow_voice_pool
+  std::atomic<bool> voice_pool_growing{false}; // set while grow_voice_pool holds synth_started off
+  int32_t voice_pool_failed = 0; // polyphony the voice pool could not grow to, not tried again or above
 
-  uint8_t* load_rom_file(const char* romname);
+  const uint8_t* load_rom_file(const char* romname);
+  void unload_rom_file(void);
   void lsgWrite(uint8_t* event, unsigned int length, int offset = 0);
+  void send_bend_range(uint8_t bendRange);
   int start_synth(void);
+  void grow_voice_pool(void);
   void stop_synth(void);
   char* handleDllPath(const char* romname);
 };
@@ -24,6 +24,30 @@
  */
 
 #include "VLSG.h"
+#include <tuple>
+#include <algorithm>
+#include <new>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VLSG_SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define VLSG_SIMD_X86 0
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
 
 const uint32_t dword_C0032188[112+104+40] =
 {
@@ -260,6 +284,8 @@ constexpr const char* VLSG::VLSG_GetName(void) const
 
 uint32_t VLSG::VLSG_GetTime(void)
 {
+  if (time_source == TIMESRC_Samples)
+    return sample_clock_time.load(std::memory_order_relaxed);
   if (get_time_func != nullptr)
     return get_time_func();
   return 0;
@@ -270,6 +296,98 @@ void VLSG::VLSG_SetFunc_GetTime(uint32_t (*get_time)())
     get_time_func = get_time;
 }
 
+// Set before VLSG_PlaybackStart, the MIDI data already written is timestamped
+// with the old source.
+bool VLSG::VLSG_SetTimeSource(uint32_t source)
+{
+    if (source > TIMESRC_Samples)
+    {
+        return false;
+    }
+    time_source = source;
+    return true;
+}
+
+// Read by VLSG_BufferVst once per ProcessPhaseGroups window, so set it between
+// buffers.
+bool VLSG::VLSG_SetMidiBatch(uint32_t flags)
+{
+    if ((flags & ~(MIDIBATCH_MergeControllers | MIDIBATCH_CancelNotes)) != 0)
+    {
+        return false;
+    }
+    midi_batch_flags = flags;
+    return true;
+}
+
+// Messages the next VLSG_PlaybackStart makes room for, see IngestMidiQueue.
+bool VLSG::VLSG_SetMidiBatchSize(unsigned int size)
+{
+    if ((size == 0) || (size > MIDI_BATCH_SIZE))
+    {
+        return false;
+    }
+    midi_batch_size_requested = size;
+    return true;
+}
+
+// Voices the next VLSG_PlaybackStart allocates, rounded up to 32. By default
+// (0) it allocates for the polyphony set at that time; set more to let SysEx
+// raise the polyphony later on without a VLSG_ResizeVoicePool.
+bool VLSG::VLSG_SetVoicePool(unsigned int voices)
+{
+    if (voices > MAX_VOICES)
+    {
+        return false;
+    }
+    voice_pool_requested = voices;
+    return true;
+}
+
+// Read by NoteOn, so set it between buffers. Voices stacked before it is
+// turned off keep playing all their notes.
+bool VLSG::VLSG_SetVoiceStacking(bool enable)
+{
+    voice_stacking = enable;
+    return true;
+}
+
+int32_t VLSG::VLSG_GetVoicePool(void) const
+{
+    return voice_capacity;
+}
+
+// Can be more than VLSG_GetVoicePool, until a VLSG_ResizeVoicePool or
+// VLSG_PlaybackStart makes room.
+int32_t VLSG::VLSG_GetPolyphony(void) const
+{
+    return polyphony_requested;
+}
+
+Midi_Batch_Stats VLSG::VLSG_GetMidiBatchStats(void) const
+{
+    Midi_Batch_Stats stats;
+
+    stats.received = midi_batch_received.load(std::memory_order_relaxed);
+    stats.merged = midi_batch_merged.load(std::memory_order_relaxed);
+    stats.cancelled = midi_batch_cancelled.load(std::memory_order_relaxed);
+    stats.duplicates = midi_batch_duplicates.load(std::memory_order_relaxed);
+    stats.overflowed = midi_batch_overflowed.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// Counts frames in ms of the output frequency at the time they were rendered,
+// carrying the remainder, so the clock stays exact across frequency changes.
+inline void VLSG::AdvanceSampleClock(uint32_t frames)
+{
+    uint32_t time;
+
+    sample_clock_fraction += frames * 1000;
+    time = sample_clock_fraction / output_frequency;
+    sample_clock_fraction -= time * output_frequency;
+    sample_clock_time.store(sample_clock_time.load(std::memory_order_relaxed) + time, std::memory_order_relaxed);
+}
+
 bool VLSG::VLSG_SetParameter(uint32_t type, uintptr_t value)
 {
     switch (type)
@@ -314,6 +432,18 @@ bool VLSG::VLSG_SetParameter(uint32_t type, uintptr_t value)
             else if (value == 0x15) { // Experimental
               return VLSG_SetPolyphony(256);
             }
+            else if (value == 0x16) { // Experimental, from here on the voice pool may need to grow, see VLSG_SetVoicePool
+              return VLSG_SetPolyphony(512);
+            }
+            else if (value == 0x17) { // Experimental
+              return VLSG_SetPolyphony(1024);
+            }
+            else if (value == 0x18) { // Experimental
+              return VLSG_SetPolyphony(2048);
+            }
+            else if (value == 0x19) { // Experimental
+              return VLSG_SetPolyphony(4096);
+            }
             return VLSG_SetPolyphony(24);
 
         case PARAMETER_Effect:
@@ -328,6 +458,30 @@ bool VLSG::VLSG_SetParameter(uint32_t type, uintptr_t value)
         case PARAMETER_VelocityFunc:  // Sysex 0x40 but yeah don't care
             return VLSG_SetVelocityFunc(value & 0xF);
 
+        case PARAMETER_ReverbPipeline:
+            return VLSG_SetReverbPipeline(value != 0);
+
+        case PARAMETER_VoiceThreads:
+            return VLSG_SetVoiceThreads(value);
+
+        case PARAMETER_CacheFile:
+            return VLSG_SetCacheFile((const char*)value);
+
+        case PARAMETER_TimeSource:
+            return VLSG_SetTimeSource(value);
+
+        case PARAMETER_MidiBatch:
+            return VLSG_SetMidiBatch(value);
+
+        case PARAMETER_VoicePool:
+            return VLSG_SetVoicePool(value);
+
+        case PARAMETER_VoiceStacking:
+            return VLSG_SetVoiceStacking(value != 0);
+
+        case PARAMETER_MidiBatchSize:
+            return VLSG_SetMidiBatchSize(value);
+
         default:
             return false;
     }
@@ -353,6 +507,7 @@ bool VLSG::VLSG_SetFrequency(unsigned int frequency)
     double freq_ratio = frequency / base_freq;
 
     output_frequency = frequency;
+    output_frequency_reciprocal = (((uint64_t)1 << 46) + frequency - 1) / frequency;
     output_size_para = base_para * freq_ratio;
     uint32_t buffer_size = base_buf * freq_ratio;
     
@@ -384,6 +539,12 @@ bool VLSG::VLSG_SetFrequency(unsigned int frequency)
     output_buffer_size_samples = buffer_size;
     output_buffer_size_bytes = 4 * buffer_size;
     InitializeReverbBuffer();
+
+    // v_freq depends on the output frequency, have the next phase redo it
+    for (int index = 0; index < voice_capacity; index++)
+    {
+        voice_data[index].freq_key = INT32_MIN;
+    }
     return true;
 }
 
@@ -396,6 +557,10 @@ bool VLSG::VLSG_SetPolyphony(unsigned int poly)
         return false;
     }
     polyphony = (int32_t)poly;
+    polyphony_requested = polyphony;
+    if ((voice_capacity != 0) && (polyphony > voice_capacity)) {
+        polyphony = voice_capacity;
+    }
     maximum_polyphony = polyphony;
     maximum_polyphony_new_value = polyphony;
     return true;
@@ -431,10 +596,103 @@ bool VLSG::VLSG_SetVelocityFunc(unsigned int curveIdx)
     return true;
 }
 
+// Only VLSG_BufferVst uses the worker; it switches over at the start of its
+// next call. VLSG_Buffer switches the worker off before it renders. The worker
+// is started the first time and parked while the pipeline is off, see
+// ReverbWorker.
+bool VLSG::VLSG_SetReverbPipeline(bool enable)
+{
+    if (enable && !reverb_worker.joinable())
+    {
+        reverb_worker = std::thread(&VLSG::ReverbWorker, this);
+    }
+
+    reverb_pipeline_requested.store(enable);
+    return true;
+}
+
+// Frames VLSG_BufferVst output lags behind its MIDI input.
+int32_t VLSG::VLSG_GetLatency(void) const
+{
+    return reverb_pipeline_requested.load() ? REVERB_PIPELINE_LATENCY : 0;
+}
+
+// Workers are started as needed and kept until the engine is destroyed, parked
+// while they get no work, see VoiceWorker; the audio thread picks up the new
+// count at the start of its next buffer, see GetVoiceThreadCount. They are left to the scheduler within the process's
+// affinity: nothing says which core the host's audio thread or the workers of
+// other instances run on.
+bool VLSG::VLSG_SetVoiceThreads(unsigned int count)
+{
+    int started;
+
+    if (count > MAX_VOICE_THREADS)
+    {
+        count = MAX_VOICE_THREADS;
+    }
+
+    started = voice_threads_started.load();
+    for (; started < (int)count; started++)
+    {
+        // Jobs published before the worker is counted below do not include it.
+        voice_threads[started] = std::thread(&VLSG::VoiceWorker, this, started + 1, voice_job_serial.load());
+        voice_threads_started.store(started + 1, std::memory_order_release);
+    }
+
+    voice_threads_requested.store(count);
+    return true;
+}
+
+// Only used by the next InitializeWaveCache for a different ROM, so set it
+// before VLSG_PlaybackStart. An empty path or nullptr turns the file off. Put
+// it in a directory only this user can write to; a cache file that others
+// could change is not mapped.
+bool VLSG::VLSG_SetCacheFile(const char* path)
+{
+    wave_cache_path = (path != nullptr) ? path : "";
+    return true;
+}
+
+inline int VLSG::GetVoiceThreadCount(void) const
+{
+    int requested = voice_threads_requested.load(std::memory_order_relaxed);
+    int started = voice_threads_started.load(std::memory_order_acquire);
+
+    return (requested < started) ? requested : started;
+}
+
+VLSG::~VLSG()
+{
+    if (reverb_worker.joinable())
+    {
+        reverb_worker_exit.store(true);
+        reverb_worker_wake.Post();
+        reverb_worker.join();
+    }
+
+    voice_threads_exit.store(true);
+    for (int index = 0; index < MAX_VOICE_THREADS; index++)
+    {
+        if (voice_threads[index].joinable())
+        {
+            voice_thread_wake[index].Post();
+            voice_threads[index].join();
+        }
+    }
+
+    UnmapWaveCacheFile();
+    DeinitializeVoicePool();
+    delete[] midi_batch;
+}
+
 bool VLSG::VLSG_PlaybackStart(void)
 {
     current_polyphony = 0;
     dword_C0000000 = 0;
+    sample_clock_time.store(0);
+    sample_clock_fraction = 0;
+    render_frame = 0;
+    period_start_frame = 0;
 
     if (!InitializeVelocityFunc())
         return false;
@@ -469,8 +727,31 @@ bool VLSG::VLSG_PlaybackStart(void)
         return false;
     }
 
+    if (!InitializeVoicePool())
+    {
+        EMPTY_DeinitializeMidiDataBuffer();
+        EMPTY_DeinitializePhase();
+        DeinitializeReverbBuffer();
+        EMPTY_DeinitializeVariables();
+        EMPTY_DeinitializeVelocityFunc();
+        return false;
+    }
+
     if (!InitializeStructures())
     {
+        DeinitializeVoicePool();
+        EMPTY_DeinitializeMidiDataBuffer();
+        EMPTY_DeinitializePhase();
+        DeinitializeReverbBuffer();
+        EMPTY_DeinitializeVariables();
+        EMPTY_DeinitializeVelocityFunc();
+        return false;
+    }
+
+    if (!InitializeWaveCache())
+    {
+        EMPTY_DeinitializeStructures();
+        DeinitializeVoicePool();
         EMPTY_DeinitializeMidiDataBuffer();
         EMPTY_DeinitializePhase();
         DeinitializeReverbBuffer();
@@ -487,6 +768,7 @@ bool VLSG::VLSG_PlaybackStop(void)
 {
     current_polyphony = 0;
 
+    EMPTY_DeinitializeWaveCache();
     EMPTY_DeinitializeStructures();
     EMPTY_DeinitializeMidiDataBuffer();
     EMPTY_DeinitializePhase();
@@ -495,13 +777,43 @@ bool VLSG::VLSG_PlaybackStop(void)
     return EMPTY_DeinitializeVelocityFunc();
 }
 
+// The original driver's format: each MIDI byte follows its 4 byte timestamp.
+// The timestamps are skipped, events are applied in the order written.
 void VLSG::VLSG_Write(const void* data, uint32_t len)
 {
     const uint8_t* ptr = (const uint8_t*)(data);
     for (; len != 0; len--)
     {
-        AddByteToMidiDataBuffer(*ptr++);
+        midi_write_record_length++;
+        if (midi_write_record_length == 5)
+        {
+            midi_write_record_length = 0;
+            AddByteToMidiEvent(*ptr);
+        }
+        ptr++;
+    }
+}
+
+// Queues a complete MIDI message or SysEx for the rendering thread, to be
+// applied by ProcessMidiData or at frame offset of the next VLSG_Buffer.
+// Only one thread may write MIDI, through this and VLSG_Write.
+bool VLSG::VLSG_PostMidi(const uint8_t* data, uint32_t len, uint32_t offset)
+{
+    Midi_Event event;
+    bool posted = true;
+
+    FlushMidiEvent();
+
+    event.offset = (offset > 0xFFFF) ? 0xFFFF : (uint16_t)offset;
+    while (len != 0)
+    {
+        event.length = (len > MIDI_EVENT_DATA) ? MIDI_EVENT_DATA : (uint8_t)len;
+        memcpy(event.data, data, event.length);
+        posted = PostMidiEvent(&event) && posted;
+        data += event.length;
+        len -= event.length;
     }
+    return posted;
 }
 
 int32_t VLSG::VLSG_Buffer(uint32_t output_buffer_counter)
@@ -511,6 +823,12 @@ int32_t VLSG::VLSG_Buffer(uint32_t output_buffer_counter)
     uint8_t *output_ptr;
     uint32_t time4;
 
+    // GenerateOutputData runs the reverb itself.
+    if (reverb_pipeline_active)
+    {
+        SwitchReverbPipeline();
+    }
+
     time1 = VLSG_GetTime();
 
     if ((output_buffer_counter == 0) || (time1 - system_time_1 > 200))
@@ -550,15 +868,18 @@ int32_t VLSG::VLSG_Buffer(uint32_t output_buffer_counter)
     }
 
     offset1 = 0;
+    voice_thread_count = GetVoiceThreadCount();
 
     output_ptr = &output_data_ptr[((output_buffer_counter & 0x0F) * output_size_para) << 4];
     
     for (counter = 4; counter != 0; counter--)
     {
-        //ProcessMidiData();
+        // Events posted for this part of the buffer, the last part takes any later ones
+        ProcessMidiEvents((counter == 1) ? UINT32_MAX : (offset1 + output_size_para));
         ProcessPhase();
         GenerateOutputData(output_ptr, offset1, offset1 + output_size_para);
         offset1 += output_size_para;
+        render_frame += output_size_para;
         dword_C0000000++;
         //system_time_1 = (((uint32_t)(dword_C0000000 * dword_C0000004)) >> 9) + dword_C0000008;
     }
@@ -568,6 +889,9 @@ int32_t VLSG::VLSG_Buffer(uint32_t output_buffer_counter)
     time4 -= time1;
     maximum_polyphony = maximum_polyphony_new_value;
 
+    // Only after time4, rendering takes no time on the sample clock.
+    AdvanceSampleClock(4 * output_size_para);
+
     if (time4 > 300)
     {
         SetMaximumVoices(2);
@@ -592,15 +916,18 @@ int32_t VLSG::VLSG_Buffer(uint32_t output_buffer_counter)
 // Seriously CBF that hardcoded buffer BS so writing the output directly on demand.
 int32_t VLSG::VLSG_BufferVst(uint32_t output_buffer_counter, double** output, int nFrames, iplug::IMidiQueue& mMidiQueue, iplug::IMidiQueueBase<iplug::ISysEx>& mSysExQueue)
 {
-  int quant = 1;
+  int quant;
   int frames_left = nFrames;
 
-  for (int offset1 = 0; frames_left > 0; frames_left -= quant)
+  if (reverb_pipeline_requested.load(std::memory_order_relaxed) != reverb_pipeline_active)
   {
-    // If uneven quants, get the correct range
-    if (frames_left < quant)
-      quant = frames_left;
+    SwitchReverbPipeline();
+  }
+  voice_thread_count = GetVoiceThreadCount();
+  IngestMidiQueue(mMidiQueue, nFrames);
 
+  for (int offset1 = 0; frames_left > 0; frames_left -= quant)
+  {
     while (!mSysExQueue.Empty()) {
       auto msg = mSysExQueue.Peek();
       if (msg.mOffset > offset1) break; // assume chronological order
@@ -609,43 +936,262 @@ int32_t VLSG::VLSG_BufferVst(uint32_t output_buffer_counter, double** output, in
       mSysExQueue.Remove();
     }
 
-    ///////////////////////////////////////////////////////////////////////////////////////
-    // FIXME: Due to the way ADSR envelopes work every output_size_para samples,
-    //        so too does the note processing.  Until the Phase generation processor
-    //        can be written to be more 'sample-accurate', can't really do much about
-    //        this otherwise there will be weird intermittent pops/clicks on note-ons.
-    ///////////////////////////////////////////////////////////////////////////////////////
-    //while (!mMidiQueue.Empty()) {
-    //  auto msg = mMidiQueue.Peek();
-    //  if (msg.mOffset > offset1) break; // assume chronological order
-    //
-    //  ProcessMidiDataVst(msg);
-    //  mMidiQueue.Remove();
-    //}
-    ///////////////////////////////////////////////////////////////////////////////////////
-    
-    // Do not progress envelope phase until after output_size_para frames (as per original hardcoded BS)
-    if (phaseAcc == INT_MIN || phaseAcc >= output_size_para) {
-      while (!mMidiQueue.Empty()) {
-        auto msg = mMidiQueue.Peek();
-        if (msg.mOffset > offset1) break; // assume chronological order
-
-        ProcessMidiDataVst(msg);
-        mMidiQueue.Remove();
+    // The control rate work of a period is spread over it: phase group n is
+    // processed n / PHASE_GROUPS of the way through, so each voice is still
+    // updated once per output_size_para frames.
+    if (phaseAcc == INT_MIN)
+    {
+      phaseAcc = 0;
+      phase_group = 0;
+    }
+    else if ((phase_group == PHASE_GROUPS) && (phaseAcc >= output_size_para))
+    {
+      phaseAcc -= output_size_para;
+      phase_group = 0;
+    }
+
+    phase_groups_due = 0;
+    if (phase_group == 0)
+    {
+      processing_phase++;
+      period_start_frame = render_frame;
+    }
+    while ((phase_group < PHASE_GROUPS) && (phaseAcc >= (int)((phase_group * output_size_para) / PHASE_GROUPS)))
+    {
+      phase_groups_due |= PHASE_GROUP_MASK(phase_group);
+      phase_group++;
+    }
+
+    // Render everything up to the next phase group or queued event in one go,
+    // nothing in the voice state can change in between.
+    if (phase_group < PHASE_GROUPS)
+      quant = (int)((phase_group * output_size_para) / PHASE_GROUPS) - phaseAcc;
+    else
+      quant = output_size_para - phaseAcc;
+    if (quant < 1)
+      quant = 1;  // output_size_para shrank mid-period, catch up one frame at a time
+
+    // Everything applied before the next ProcessPhaseGroups call, and before
+    // the next SysEx, is coalesced as one window.
+    if (midi_batch_coalesced < midi_batch_count)
+    {
+      uint32_t window_end = (phase_groups_due != 0) ? offset1 : offset1 + quant;
+      uint32_t last = midi_batch_coalesced;
+
+      if (!mSysExQueue.Empty() && (uint32_t)mSysExQueue.Peek().mOffset <= window_end)
+        window_end = mSysExQueue.Peek().mOffset - 1;
+      while ((last < midi_batch_count) && (midi_batch[last].offset <= window_end))
+        last++;
+      if (last > midi_batch_coalesced)
+      {
+        CoalesceMidiBatch(midi_batch_coalesced, last);
+        midi_batch_coalesced = last;
       }
-      ProcessPhase();
-      phaseAcc = (phaseAcc < quant) ? 0 : (phaseAcc - output_size_para);
     }
+
+    // MIDI events are applied at their own frame. Voices started in a group that
+    // is not processed right after get their first envelope step from
+    // StartPlayingVoice instead, see phase_groups_due.
+    while ((midi_batch_index < midi_batch_count) && (midi_batch[midi_batch_index].offset <= (uint32_t)offset1)) {
+      const Midi_Batch_Event* event = &(midi_batch[midi_batch_index++]);
+
+      if (event->status != 0)
+        ProcessChannelMessage(event->status, event->data1, event->data2);
+    }
+    while ((midi_batch_index < midi_batch_count) && (midi_batch[midi_batch_index].status == 0))
+      midi_batch_index++;
+
+    if (phase_groups_due != 0)
+    {
+      ProcessPhaseGroups((processing_phase - 1) & 7, phase_groups_due);
+    }
+    phase_groups_due = 0xFFFFFFFFu;
+
+    if (quant > frames_left)
+      quant = frames_left;
+    if (!mSysExQueue.Empty() && mSysExQueue.Peek().mOffset > offset1 && mSysExQueue.Peek().mOffset - offset1 < quant)
+      quant = mSysExQueue.Peek().mOffset - offset1;
+    if (midi_batch_index < midi_batch_count && midi_batch[midi_batch_index].offset - offset1 < (uint32_t)quant)
+      quant = midi_batch[midi_batch_index].offset - offset1;
+
     phaseAcc += quant;
     
     GenerateOutputDataVst(output, offset1, offset1 + quant);
     offset1 += quant;
+    render_frame += quant;
   }
 
   CountActiveVoices();
+  AdvanceSampleClock(nFrames);
   return current_polyphony;
 }
 
+// Takes the channel messages of this call off the queue in one go, so each
+// window between two ProcessPhaseGroups calls can be coalesced before any of
+// it is applied. Messages for later frames are left queued.
+void VLSG::IngestMidiQueue(iplug::IMidiQueue& queue, int nFrames)
+{
+  Midi_Batch_Event* event;
+  bool sorted = true;
+  uint64_t overflowed = 0;
+
+  midi_batch_count = 0;
+  midi_batch_index = 0;
+  midi_batch_coalesced = 0;
+
+  while (!queue.Empty()) {
+    auto msg = queue.Peek();
+    if (msg.mOffset >= nFrames) break;
+    queue.Remove();
+
+    if ((msg.mStatus & 0x80) == 0 || msg.mStatus >= 0xF0) continue;
+    if (midi_batch_count >= midi_batch_capacity) {
+      overflowed++;
+      continue;
+    }
+
+    event = &(midi_batch[midi_batch_count]);
+    event->offset = (msg.mOffset > 0) ? msg.mOffset : 0;
+    event->status = msg.mStatus;
+    event->data1 = msg.mData1 & 0x7F;
+    event->data2 = msg.mData2 & 0x7F;
+    if ((midi_batch_count != 0) && (event->offset < midi_batch[midi_batch_count - 1].offset))
+      sorted = false;
+    midi_batch_count++;
+  }
+
+  if (!sorted)
+    SortMidiBatch();
+
+  midi_batch_received.fetch_add(midi_batch_count, std::memory_order_relaxed);
+  if (overflowed != 0)
+    midi_batch_overflowed.fetch_add(overflowed, std::memory_order_relaxed);
+}
+
+// Stable bottom-up merge sort by frame, for hosts that queue out of order.
+void VLSG::SortMidiBatch(void)
+{
+  Midi_Batch_Event* source = midi_batch;
+  Midi_Batch_Event* target = midi_batch_sorted;
+  uint32_t width, start, middle, end;
+
+  for (width = 1; width < midi_batch_count; width *= 2) {
+    for (start = 0; start < midi_batch_count; start += 2 * width) {
+      middle = (start + width < midi_batch_count) ? start + width : midi_batch_count;
+      end = (start + 2 * width < midi_batch_count) ? start + 2 * width : midi_batch_count;
+      std::merge(source + start, source + middle, source + middle, source + end, target + start,
+                 [](const Midi_Batch_Event& a, const Midi_Batch_Event& b) { return a.offset < b.offset; });
+    }
+    std::swap(source, target);
+  }
+
+  if (source != midi_batch)
+    memcpy(midi_batch, source, midi_batch_count * sizeof(Midi_Batch_Event));
+}
+
+// The channel values a message only overwrites, one bit each, or 0.
+static uint32_t midi_batch_value_bit(const Midi_Batch_Event* event)
+{
+  switch (event->status & 0xF0) {
+  case 0xB0:
+    switch (event->data1) {
+    case 0x01: return 0x01;  // modulation
+    case 0x07: return 0x02;  // volume
+    case 0x0A: return 0x04;  // pan
+    case 0x0B: return 0x08;  // expression
+    default: return 0;
+    }
+  case 0xD0: return 0x10;  // channel pressure
+  case 0xE0: return 0x20;  // pitch bend
+  default: return 0;
+  }
+}
+
+// Drops what nobody would notice from midi_batch[first..last), which is all
+// applied before the next ProcessPhaseGroups call with no SysEx in between.
+// Channel values are only read there and by later messages on the same
+// channel, so an update is dead if the channel gets another update of the same
+// value with no other message of the channel in between.
+void VLSG::CoalesceMidiBatch(uint32_t first, uint32_t last)
+{
+  Midi_Batch_Event* event;
+  uint32_t index, channel_num, value_bit;
+  uint32_t overwritten[MIDI_CHANNELS] = {};
+  uint64_t merged = 0, cancelled = 0, duplicates = 0;
+
+  if (midi_batch_flags & MIDIBATCH_CancelNotes) {
+    int16_t* note_on;
+    uint32_t held = 1 << DRUM_CHANNEL;  // channels whose note offs may not release a note at once
+
+    for (channel_num = 0; channel_num < MIDI_CHANNELS; channel_num++) {
+      if (channel_data[channel_num].chflags & (CHFLAG_Sustain | CHFLAG_Sostenuto))
+        held |= 1 << channel_num;
+    }
+
+    for (index = first; index < last; index++) {
+      event = &(midi_batch[index]);
+      channel_num = event->status & 0x0F;
+      note_on = &(midi_batch_note_on[channel_num][event->data1]);
+
+      switch (event->status & 0xF0) {
+      case 0x90:
+        if (event->data2 != 0) {
+          if ((*note_on >= 0) && (midi_batch[*note_on].offset == event->offset) && (midi_batch[*note_on].data2 == event->data2)) {
+            event->status = 0;
+            duplicates++;
+          } else {
+            *note_on = (int16_t)index;
+          }
+          break;
+        }
+        [[fallthrough]];  // a note off
+      case 0x80:
+        if ((*note_on >= 0) && ((held & (1 << channel_num)) == 0)) {
+          midi_batch[*note_on].status = 0;
+          event->status = 0;
+          cancelled++;
+        }
+        *note_on = -1;
+        break;
+      default:
+        if (midi_batch_value_bit(event) == 0)
+          held |= 1 << channel_num;
+        break;
+      }
+    }
+
+    for (index = first; index < last; index++) {
+      if ((midi_batch[index].status & 0xF0) == 0x90)
+        midi_batch_note_on[midi_batch[index].status & 0x0F][midi_batch[index].data1] = -1;
+    }
+  }
+
+  if (midi_batch_flags & MIDIBATCH_MergeControllers) {
+    for (index = last; index-- > first; ) {
+      event = &(midi_batch[index]);
+      if (event->status == 0) continue;
+
+      channel_num = event->status & 0x0F;
+      value_bit = midi_batch_value_bit(event);
+      if (value_bit == 0) {
+        overwritten[channel_num] = 0;
+      } else if (overwritten[channel_num] & value_bit) {
+        event->status = 0;
+        merged++;
+      } else {
+        overwritten[channel_num] |= value_bit;
+      }
+    }
+  }
+
+  if (merged != 0)
+    midi_batch_merged.fetch_add(merged, std::memory_order_relaxed);
+  if (cancelled != 0)
+    midi_batch_cancelled.fetch_add(cancelled, std::memory_order_relaxed);
+  if (duplicates != 0)
+    midi_batch_duplicates.fetch_add(duplicates, std::memory_order_relaxed);
+}
+
 void VLSG::VLSG_AddMidiData(uint8_t *ptr, uint32_t len)
 {
   VLSG_Write(ptr, len);
@@ -664,42 +1210,64 @@ constexpr bool VLSG::EMPTY_DeinitializeVelocityFunc(void)
 
 void VLSG::voice_set_freq(Voice_Data *voice_data_ptr, int32_t pitch)
 {
-    Channel_Data *channel_ptr;
+    int index;
     int32_t value1;
     uint32_t value2;
 
-    channel_ptr = &(channel_data[voice_data_ptr->channel_num_2 >> 1]);
-    value1 = (((int32_t)(channel_ptr->pitch_bend * channel_ptr->pitch_bend_sense)) >> 13) + pitch + channel_ptr->fine_tune + 2180;
+    index = GetVoiceIndex(voice_data_ptr);
+    value1 = voice_get_freq_key(voice_data_ptr, pitch);
+    voice_data_ptr->freq_key = value1;
     value2 = dword_C0032188[216 + (value1 >> 8)] * dword_C0032588[value1 & 0xFF];
 
-    voice_data_ptr->v_freq = value2;
+    voice_mix.v_freq[index] = value2;
     //switch (output_frequency)
     //{
         //case 11025:
-        //    voice_data_ptr->v_freq = value2 >> 17;
+        //    voice_mix.v_freq[index] = value2 >> 17;
         //    break;
         //case 22050:
-        //    voice_data_ptr->v_freq = value2 >> 18;
+        //    voice_mix.v_freq[index] = value2 >> 18;
         //    break;
         //case 44100:
-        //    voice_data_ptr->v_freq = value2 >> 19;
+        //    voice_mix.v_freq[index] = value2 >> 19;
         //    break;
         //case 16538:
-        //    voice_data_ptr->v_freq = (value2 / 3) >> 16;
+        //    voice_mix.v_freq[index] = (value2 / 3) >> 16;
         //    break;
         //default:
-            voice_data_ptr->v_freq = (uint32_t)((value2 >> 17) * 11025) / output_frequency;
+            // (value2 >> 17) * 11025 is below 2^29, where this is exact division by output_frequency
+            voice_mix.v_freq[index] = (uint32_t)(((uint64_t)((value2 >> 17) * 11025) * output_frequency_reciprocal) >> 46);
         //    break;
     //}
 }
 
-int32_t VLSG::voice_get_index(Voice_Data *voice_data_ptr, int32_t pitch)
+// The pitch table index voice_set_freq looks v_freq up with.
+inline int32_t VLSG::voice_get_freq_key(const Voice_Data *voice_data_ptr, int32_t pitch) const
+{
+    const Channel_Data *channel_ptr;
+
+    channel_ptr = &(channel_data[voice_data_ptr->channel_num_2 >> 1]);
+    return (((int32_t)(channel_ptr->pitch_bend * channel_ptr->pitch_bend_sense)) >> 13) + pitch + channel_ptr->fine_tune + 2180;
+}
+
+// voice_set_freq, skipped when neither the pitch nor the channel's pitch bend
+// and tuning changed since v_freq was last computed.
+inline void VLSG::voice_update_freq(Voice_Data *voice_data_ptr, int32_t pitch)
+{
+    if (voice_get_freq_key(voice_data_ptr, pitch) != voice_data_ptr->freq_key)
+    {
+        voice_set_freq(voice_data_ptr, pitch);
+    }
+}
+
+// The note the ROM tables are looked up with: the played note transposed by
+// channel coarse tune and program detune and folded into 12-108 (drums are
+// not transposed).
+int32_t VLSG::voice_get_note(const Voice_Data *voice_data_ptr) const
 {
-    uint32_t offset1;
     int32_t channel_num_2;
     int32_t note_number;
 
-    offset1 = rom_change_bank(3, pitch);
     channel_num_2 = (int16_t)(voice_data_ptr->channel_num_2 & ~1);
     note_number = voice_data_ptr->note_number;
 
@@ -719,7 +1287,12 @@ int32_t VLSG::voice_get_index(Voice_Data *voice_data_ptr, int32_t pitch)
         }
     }
 
-    return rom_read_word_at(offset1 + 2 * note_number);
+    return note_number;
+}
+
+inline const Note_Template* VLSG::voice_get_template(const Voice_Data *voice_data_ptr) const
+{
+    return &(wave_cache.note_templates[((uint32_t)voice_data_ptr->template_row << 7) + voice_get_note(voice_data_ptr)]);
 }
 
 void VLSG::ProgramChange(Program_Data *program_data_ptr, uint32_t program_number)
@@ -751,6 +1324,7 @@ void VLSG::ProgramChange(Program_Data *program_data_ptr, uint32_t program_number
         program_data_ptr->field_16 >>= 8;
         program_data_ptr->field_18 >>= 8;
         program_data_ptr->field_1A >>= 8;
+        program_data_ptr->template_row = 2 * program_number + (2 - counter);
 
         program_data_ptr++;
     }
@@ -764,6 +1338,7 @@ void VLSG::VoiceSoundOff(Voice_Data *voice_data_ptr)
     voice_data_ptr->vflags &= VFLAG_MaskC0;
     voice_set_flags2(voice_data_ptr);
     voice_set_flags(voice_data_ptr);
+    UpdateVoicePriority(GetVoiceIndex(voice_data_ptr));
 }
 
 void VLSG::VoiceNoteOff(Voice_Data *voice_data_ptr)
@@ -776,18 +1351,16 @@ void VLSG::VoiceNoteOff(Voice_Data *voice_data_ptr)
         voice_set_flags2(voice_data_ptr);
         voice_set_flags(voice_data_ptr);
     }
+    UpdateVoicePriority(GetVoiceIndex(voice_data_ptr));
 }
 
 void VLSG::AllChannelNotesOff(int32_t channel_num)
 {
     int index;
 
-    for (index = 0; index < MAX_VOICES; index++)
+    for (index = NextChannelVoice(channel_num, 0, voice_capacity); index < voice_capacity; index = NextChannelVoice(channel_num, index + 1, voice_capacity))
     {
-        if ((voice_data[index].channel_num_2 >> 1) == channel_num)
-        {
-            VoiceNoteOff(&(voice_data[index]));
-        }
+        VoiceNoteOff(&(voice_data[index]));
     }
 }
 
@@ -795,12 +1368,9 @@ void VLSG::AllChannelSoundsOff(int32_t channel_num)
 {
     int index;
 
-    for (index = 0; index < MAX_VOICES; index++)
+    for (index = NextChannelVoice(channel_num, 0, voice_capacity); index < voice_capacity; index = NextChannelVoice(channel_num, index + 1, voice_capacity))
     {
-        if ((voice_data[index].channel_num_2 >> 1) == channel_num)
-        {
-            VoiceSoundOff(&(voice_data[index]));
-        }
+        VoiceSoundOff(&(voice_data[index]));
     }
 }
 
@@ -808,17 +1378,11 @@ void VLSG::ControllerSettingsOn(int32_t channel_num)
 {
     int index;
 
-    for (index = 0; index < maximum_polyphony; index++)
+    for (index = NextChannelVoice(channel_num, 0, maximum_polyphony); index < maximum_polyphony; index = NextChannelVoice(channel_num, index + 1, maximum_polyphony))
     {
-        if ((voice_data[index].channel_num_2 >> 1) == channel_num)
+        if ((voice_data[index].vflags & VFLAG_Value80) == 0)
         {
-            if (voice_data[index].note_number != 255)
-            {
-                if ((voice_data[index].vflags & VFLAG_Value80) == 0)
-                {
-                    voice_data[index].vflags |= VFLAG_Value40;
-                }
-            }
+            voice_data[index].vflags |= VFLAG_Value40;
         }
     }
 }
@@ -827,97 +1391,85 @@ void VLSG::ControllerSettingsOff(int32_t channel_num)
 {
     int index;
 
-    for (index = 0; index < maximum_polyphony; index++)
+    for (index = NextChannelVoice(channel_num, 0, maximum_polyphony); index < maximum_polyphony; index = NextChannelVoice(channel_num, index + 1, maximum_polyphony))
     {
-        if ((voice_data[index].channel_num_2 >> 1) == channel_num)
+        voice_data[index].vflags &= ~VFLAG_Value40;
+        if ((voice_data[index].vflags & VFLAG_Value80) != 0)
         {
-            if (voice_data[index].note_number != 255)
-            {
-                voice_data[index].vflags &= ~VFLAG_Value40;
-                if ((voice_data[index].vflags & VFLAG_Value80) != 0)
-                {
-                    voice_data[index].vflags &= VFLAG_MaskC0;
+            voice_data[index].vflags &= VFLAG_MaskC0;
 
-                    voice_set_flags2(&(voice_data[index]));
-                    voice_set_flags(&(voice_data[index]));
-                }
-            }
+            voice_set_flags2(&(voice_data[index]));
+            voice_set_flags(&(voice_data[index]));
         }
     }
 }
 
 void VLSG::StartPlayingVoice(Voice_Data *voice_data_ptr, Channel_Data *channel_data_ptr, Program_Data *program_data_ptr)
 {
-    uint16_t value0;
-    uint32_t value1;
     int32_t value2;
     int32_t value3;
-    int32_t channel_num_2;
     int32_t value4;
     int32_t value5;
     int32_t value6;
-    int index;
+    int index, index2;
     const int32_t *drum_exc_pair;
     uint32_t value7;
     int32_t value8;
+    int voice_index;
+    int32_t channel_num_2;
+    int32_t note_number;
+    int32_t wave_index;
+    Wave_Cache_Entry wave;
 
+    voice_index = GetVoiceIndex(voice_data_ptr);
     voice_data_ptr->detune = program_data_ptr->detune;
     voice_data_ptr->pgm_f0E = program_data_ptr->field_0E;
     voice_data_ptr->pgm_f10 = program_data_ptr->field_10;
     voice_data_ptr->index = program_data_ptr->index;
     voice_data_ptr->pgm_f14 = program_data_ptr->field_14;
+    voice_data_ptr->template_row = program_data_ptr->template_row;
 
-    value1 = (uint16_t)rom_read_word_at(rom_change_bank(2, (program_data_ptr->field_02 & 0xFFF) + voice_get_index(voice_data_ptr, program_data_ptr->field_00 >> 8)));
-    value2 = 0;
-    value0 = rom_read_word();
-    value1 |= (value0 & 0xFF) << 16;
-    voice_data_ptr->wv_fpos = value1 << 10;
-
-    value1 = value0 >> 8;
-    value0 = rom_read_word();
-    value1 |= value0 << 8;
-    voice_data_ptr->wv_end = value1 & 0x3FFFFF;
-
-    rom_read_word();
-    value1 = rom_read_word();
-
-    value0 = rom_read_word();
-    value1 |= (value0 & 0xFF) << 16;
-    voice_data_ptr->wv_un1_hi = value0 >> 8;
-    voice_data_ptr->wv_un1_lo = value0 & 0xFF;
-    voice_data_ptr->wv_start = value1 & 0x3FFFFF;
-
-    voice_data_ptr->base_freq = rom_read_word();
-    value0 = rom_read_word();
+    // The bank 2 entry of the note's wave, as decoded by InitializeWaveCache.
+    note_number = voice_get_note(voice_data_ptr);
+    wave_index = voice_get_template(voice_data_ptr)->wave_index;
+    if ((wave_index >= 0) && ((uint32_t)wave_index < wave_cache.entry_count))
+    {
+        wave = wave_cache.entries[wave_index];
+    }
+    else
+    {
+        memset(&wave, 0, sizeof(wave));
+    }
 
-    voice_data_ptr->wv_un3_lo = value0 & 0xFF;
-    voice_data_ptr->field_0C[3] = 0;
-    voice_data_ptr->field_0C[2] = 0;
-    voice_data_ptr->wv_pos = ((voice_data_ptr->wv_fpos & ~0x400u) >> 10) - 2;
-    voice_data_ptr->wv_un3_hi = value0 >> 8;
+    voice_data_ptr->wv_un1_hi = wave.wv_un1 >> 8;
+    voice_data_ptr->wv_un1_lo = wave.wv_un1 & 0xFF;
+    voice_data_ptr->base_freq = wave.base_freq;
+    voice_data_ptr->wv_un3_lo = wave.wv_un3_lo;
 
-    value3 = program_data_ptr->field_02 & 0x7000;
-    if ( value3 != 0x7000 )
+    if (wave.valid)
     {
-        value2 = voice_data_ptr->note_number;
-        channel_num_2 = (int16_t)(voice_data_ptr->channel_num_2 & ~1);
-        if (channel_num_2 != (2 * DRUM_CHANNEL))
-        {
-            value2 += channel_data[channel_num_2 >> 1].coarse_tune;
-            value2 += (voice_data_ptr->detune + 128) >> 8;
-
-            if (value2 < 12)
-            {
-                value2 += 12 * ((23 - value2) / 12);
-            }
-
-            if (value2 > 108)
-            {
-                value2 -= 12 * ((value2 - 97) / 12);
-            }
-        }
+        voice_mix.wv_fpos[voice_index] = wave.start << 10;
+        voice_mix.wv_end[voice_index] = wave.end;
+        voice_mix.wv_start[voice_index] = wave.loop_start;
+        voice_mix.wv_base[voice_index] = wave.first_bias;
+        voice_data_ptr->wv_loop_base = wave.loop_bias;
+    }
+    else
+    {
+        // A wave the cache rejected: read the silent samples and let the
+        // first wrap check free the voice.
+        voice_mix.wv_fpos[voice_index] = 0;
+        voice_mix.wv_end[voice_index] = 0;
+        voice_mix.wv_start[voice_index] = 0;
+        voice_mix.wv_base[voice_index] = 0;
+        voice_data_ptr->wv_loop_base = 0;
+    }
 
-        value2 = (value2 - voice_data_ptr->wv_un1_hi) << 8;
+    value2 = 0;
+    value3 = program_data_ptr->field_02 & 0x7000;
+    if ( value3 != 0x7000 )
+    {
+        value2 = (note_number - voice_data_ptr->wv_un1_hi) << 8;
 
         for (; value3 != 0; value3 -= 0x1000)
         {
@@ -964,7 +1516,7 @@ void VLSG::StartPlayingVoice(Voice_Data *voice_data_ptr, Channel_Data *channel_d
     }
 
     voice_data_ptr->field_4C = 0;
-    voice_data_ptr->field_2C = 0;
+    voice_mix.field_2C[voice_index] = 0;
     voice_data_ptr->field_52 = 0;
     voice_data_ptr->vflags = 0;
     voice_data_ptr->v_vol = 0;
@@ -973,11 +1525,9 @@ void VLSG::StartPlayingVoice(Voice_Data *voice_data_ptr, Channel_Data *channel_d
 
     if ((channel_data_ptr->chflags & CHFLAG_Sostenuto) != 0)
     {
-        for (index = 0; index < maximum_polyphony; index++)
+        for (index = note_voice_head[voice_data_ptr->channel_num_2][voice_data_ptr->note_number]; index >= 0; index = note_voice_next[index])
         {
-            if (voice_data[index].note_number == 255) continue;
-            if (voice_data_ptr->note_number != voice_data[index].note_number) continue;
-            if (voice_data[index].channel_num_2 != voice_data_ptr->channel_num_2) continue;
+            if (index >= maximum_polyphony) continue;
             if ((voice_data[index].vflags & VFLAG_Value80) == 0) continue;
             if ((voice_data[index].vflags & VFLAG_Value40) == 0) continue;
 
@@ -1008,14 +1558,17 @@ void VLSG::StartPlayingVoice(Voice_Data *voice_data_ptr, Channel_Data *channel_d
         {
             if (drum_exc_pair[0] != voice_data_ptr->note_number) continue;
 
-            for (index = 0; index < maximum_polyphony; index++)
+            for (channel_num_2 = 2 * DRUM_CHANNEL; channel_num_2 <= 2 * DRUM_CHANNEL + 1; channel_num_2++)
             {
-                if (voice_data[index].note_number == drum_exc_pair[1])
+                index = note_voice_head[channel_num_2][drum_exc_pair[1]];
+                while (index >= 0)
                 {
-                    if ((voice_data[index].channel_num_2 & ~1) == (2 * DRUM_CHANNEL))
+                    index2 = note_voice_next[index];
+                    if (index < maximum_polyphony)
                     {
-                        voice_data[index].note_number = 255;
+                        SetVoiceFree(index);
                     }
+                    index = index2;
                 }
             }
         }
@@ -1037,16 +1590,20 @@ void VLSG::StartPlayingVoice(Voice_Data *voice_data_ptr, Channel_Data *channel_d
         voice_data_ptr->v_panpot = rom_read_word_at(value7 + 2 * value8 + 256);
         voice_set_panpot(voice_data_ptr);
     }
+
+    // Unless ProcessPhase is about to run for it, take the first envelope step
+    // now rather than play with the gain left in the slot.
+    if (((phase_groups_due & PHASE_GROUP_MASK(voice_index % PHASE_GROUPS)) == 0) && (voice_data_ptr->note_number != 255))
+    {
+        UpdateVoiceEnvelope(voice_index);
+    }
 }
 
 void VLSG::AllVoicesSoundsOff(void)
 {
-    for (int index = 0; index < MAX_VOICES; index++)
+    for (int index = NextActiveVoice(0, voice_capacity); index < voice_capacity; index = NextActiveVoice(index + 1, voice_capacity))
     {
-        if (voice_data[index].note_number != 255)
-        {
-            VoiceSoundOff(&(voice_data[index]));
-        }
+        VoiceSoundOff(&(voice_data[index]));
     }
 }
 
@@ -1065,19 +1622,253 @@ constexpr bool VLSG::EMPTY_DeinitializeVariables(void)
 
 inline void VLSG::CountActiveVoices(void)
 {
-  //int active_voices = 0;
+  uint32_t bits;
+
   current_polyphony = 0;
 
-  // TODO track this in real-time rather than per-Block Request
-  for (int index = 0; index < maximum_polyphony; index++)
+  for (int index = 0; index < maximum_polyphony; index += 32)
   {
-      if (voice_data[index].note_number != 255)
-      {
-        //active_voices++;
-        ++current_polyphony;
-      }
+    bits = voice_active[index >> 5];
+    if (maximum_polyphony - index < 32)
+    {
+      bits &= (1u << (maximum_polyphony - index)) - 1;
+    }
+
+    // Population count of the word
+    bits = bits - ((bits >> 1) & 0x55555555);
+    bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+    current_polyphony += (((bits + (bits >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+  }
+}
+
+// Voice slots with note_number != 255 have their bit set in voice_active and in
+// their channel's channel_voices, and are linked into the note_voice_head list
+// of their channel_num_2 and note_number. Every write of note_number goes
+// through SetVoiceActive/SetVoiceFree to keep these so. Iterating the bits
+// visits voices in slot order, like the full scans did.
+// A voice keeps its slot for as long as it plays, so Voice_Data pointers and
+// indexes stay valid until it is freed.
+inline void VLSG::SetVoiceActive(int index)
+{
+  int16_t *head;
+
+  voice_active[index >> 5] |= 1u << (index & 31);
+  channel_voices[voice_data[index].channel_num_2 >> 1][index >> 5] |= 1u << (index & 31);
+  voice_priority[index] = VOICE_PRIORITIES - 1;
+  priority_voices[VOICE_PRIORITIES - 1][index >> 5] |= 1u << (index & 31);
+  priority_counts[VOICE_PRIORITIES - 1]++;
+  priority_used |= 1u << (VOICE_PRIORITIES - 1);
+
+  head = &(note_voice_head[voice_data[index].channel_num_2][voice_data[index].note_number]);
+  note_voice_prev[index] = -1;
+  note_voice_next[index] = *head;
+  if (*head >= 0)
+  {
+    note_voice_prev[*head] = index;
+  }
+  *head = index;
+}
+
+// Free slots are parked on the silent samples at the start of the wave cache,
+// so the mix kernels can run over them between active voices without effect.
+inline void VLSG::SetVoiceFree(int index)
+{
+  if (voice_active[index >> 5] & (1u << (index & 31)))
+  {
+    voice_active[index >> 5] &= ~(1u << (index & 31));
+    channel_voices[voice_data[index].channel_num_2 >> 1][index >> 5] &= ~(1u << (index & 31));
+    SetVoicePriority(index, -1);
+
+    if (note_voice_prev[index] >= 0)
+    {
+      note_voice_next[note_voice_prev[index]] = note_voice_next[index];
+    }
+    else
+    {
+      note_voice_head[voice_data[index].channel_num_2][voice_data[index].note_number] = note_voice_next[index];
+    }
+    if (note_voice_next[index] >= 0)
+    {
+      note_voice_prev[note_voice_next[index]] = note_voice_prev[index];
+    }
+  }
+
+  voice_data[index].note_number = 255;
+  ParkVoice(index);
+}
+
+// The mixer side of SetVoiceFree, which is all a voice thread may touch.
+inline void VLSG::ParkVoice(int index)
+{
+  voice_mix.wv_fpos[index] = 0;
+  voice_mix.wv_end[index] = 1;
+  voice_mix.wv_start[index] = 1;
+  voice_mix.wv_base[index] = 0;
+  voice_mix.v_freq[index] = 0;
+  voice_mix.v_stack[index] = 1;
+}
+
+static inline int lowest_set_bit(uint32_t value)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, value);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctz(value);
+#endif
+}
+
+static inline int highest_set_bit(uint32_t value)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse(&index, value);
+  return static_cast<int>(index);
+#else
+  return 31 - __builtin_clz(value);
+#endif
+}
+
+// Lowest index in [index, limit) with its bit set, or limit if there is none.
+// Only the bits in mask are looked at in each word.
+static inline int next_set_bit(const uint32_t *bitmap, int index, int limit, uint32_t mask = 0xFFFFFFFFu)
+{
+  uint32_t bits;
+
+  while (index < limit)
+  {
+    bits = bitmap[index >> 5] & mask & (0xFFFFFFFFu << (index & 31));
+    if (bits != 0)
+    {
+      index = (index & ~31) + lowest_set_bit(bits);
+      return (index < limit) ? index : limit;
+    }
+    index = (index & ~31) + 32;
+  }
+  return limit;
+}
+
+// Lowest active voice index in [index, limit), or limit if there is none.
+inline int VLSG::NextActiveVoice(int index, int limit) const
+{
+  return next_set_bit(voice_active, index, limit);
+}
+
+// Same as NextActiveVoice below maximum_polyphony, for the voices in the phase
+// groups of group_mask.
+inline int VLSG::NextPhaseVoice(int index, uint32_t group_mask) const
+{
+  return next_set_bit(voice_active, index, maximum_polyphony, group_mask);
+}
+
+// Same as NextActiveVoice, for the voices playing on one MIDI channel.
+inline int VLSG::NextChannelVoice(int32_t channel_num, int index, int limit) const
+{
+  return next_set_bit(channel_voices[channel_num], index, limit);
+}
+
+// Moves an active voice to another priority_voices bucket, or out of all of
+// them for a priority of -1.
+inline void VLSG::SetVoicePriority(int index, int priority)
+{
+  priority_voices[voice_priority[index]][index >> 5] &= ~(1u << (index & 31));
+  if (--priority_counts[voice_priority[index]] == 0)
+  {
+    priority_used &= ~(1u << voice_priority[index]);
+  }
+
+  if (priority >= 0)
+  {
+    voice_priority[index] = priority;
+    priority_voices[priority][index >> 5] |= 1u << (index & 31);
+    priority_counts[priority]++;
+    priority_used |= 1u << priority;
+  }
+}
+
+// Voices are stolen from the lowest priority up. The priority is the magnitude
+// of the voice's current gain in the mixer, two buckets per bit, with released
+// voices below held ones of the same magnitude. A voice that was just started
+// stays at the top until the envelope has been run for it once.
+inline void VLSG::UpdateVoicePriority(int index)
+{
+  int priority;
+
+  if ((voice_active[index >> 5] & (1u << (index & 31))) == 0) return;
+
+  priority = 0;
+  if (voice_mix.field_38[index] > 0)
+  {
+    priority = highest_set_bit(voice_mix.field_38[index] * voice_mix.v_stack[index]) + 1;
+    if (priority > VOICE_PRIORITIES / 2 - 1)
+    {
+      priority = VOICE_PRIORITIES / 2 - 1;
+    }
   }
-  //current_polyphony = active_voices;
+  priority = 2 * priority + (((voice_data[index].vflags & VFLAG_Value80) == 0) ? 1 : 0);
+
+  if (priority != voice_priority[index])
+  {
+    SetVoicePriority(index, priority);
+  }
+}
+
+// Lowest free voice index in [0, limit), or limit if every slot is in use.
+// With a group_mask, only the slots of those phase groups are considered.
+inline int VLSG::FindFreeVoice(int limit, uint32_t group_mask) const
+{
+  uint32_t bits;
+  int index;
+
+  for (index = 0; index < limit; index += 32)
+  {
+    bits = ~voice_active[index >> 5] & group_mask;
+    if (bits != 0)
+    {
+      index += lowest_set_bit(bits);
+      return (index < limit) ? index : limit;
+    }
+  }
+  return limit;
+}
+
+// Splits the active voices below maximum_polyphony into lane ranges for the
+// mix kernels. A range runs from the first to the last active voice of adjacent
+// 32-slot groups that have any; free slots inside it mix silence. Returns the
+// number of ranges, at most (voice_capacity / 32 + 1) / 2.
+inline int VLSG::GetActiveVoiceRanges(int *range_start, int *range_end) const
+{
+  uint32_t bits;
+  int index;
+  int count;
+  bool in_range;
+
+  count = 0;
+  in_range = false;
+  for (index = 0; index < maximum_polyphony; index += 32)
+  {
+    bits = voice_active[index >> 5];
+    if (maximum_polyphony - index < 32)
+    {
+      bits &= (1u << (maximum_polyphony - index)) - 1;
+    }
+
+    if (bits == 0)
+    {
+      in_range = false;
+      continue;
+    }
+
+    if (!in_range)
+    {
+      range_start[count] = index + lowest_set_bit(bits);
+      count++;
+      in_range = true;
+    }
+    range_end[count - 1] = index + highest_set_bit(bits) + 1;
+  }
+  return count;
 }
 
 void VLSG::ReduceActiveVoices(int32_t maximum_voices)
@@ -1096,6 +1887,7 @@ void VLSG::ReduceActiveVoices(int32_t maximum_voices)
         }
 
         CountActiveVoices();
+        active_voices = current_polyphony;
 
         index3 = index2;
         do
@@ -1104,7 +1896,7 @@ void VLSG::ReduceActiveVoices(int32_t maximum_voices)
             {
                 if (voice_data[index3].vflags & VFLAG_Value80)
                 {
-                    voice_data[index3].note_number = 255;
+                    SetVoiceFree(index3);
                     active_voices--;
 
                     if (active_voices <= maximum_voices)
@@ -1126,7 +1918,7 @@ void VLSG::ReduceActiveVoices(int32_t maximum_voices)
         {
             if (voice_data[index2].note_number != 255)
             {
-                voice_data[index2].note_number = 255;
+                SetVoiceFree(index2);
                 active_voices--;
 
                 if (active_voices <= maximum_voices)
@@ -1150,7 +1942,7 @@ void VLSG::ReduceActiveVoices(int32_t maximum_voices)
     {
         for (index1 = 0; index1 < maximum_polyphony; index1++)
         {
-            voice_data[index1].note_number = 255;
+            SetVoiceFree(index1);
         }
         current_polyphony = 0;
     }
@@ -1158,13 +1950,30 @@ void VLSG::ReduceActiveVoices(int32_t maximum_voices)
 
 void VLSG::SetMaximumVoices(int maximum_voices)
 {
+    int index1, index2;
+
+    if (maximum_voices > voice_capacity)
+    {
+        maximum_voices = voice_capacity;
+    }
+
     ReduceActiveVoices(maximum_voices);
-    DefragmentVoices();
+
+    // Move the voices left above the new limit into free slots below it.
+    for (index1 = NextActiveVoice(maximum_voices, maximum_polyphony); index1 < maximum_polyphony; index1 = NextActiveVoice(index1 + 1, maximum_polyphony))
+    {
+        index2 = FindFreeVoice(maximum_voices);
+        if (index2 >= maximum_voices) break;
+
+        CopyVoice(index2, index1);
+        SetVoiceActive(index2);
+        SetVoiceFree(index1);
+    }
     maximum_polyphony = maximum_voices;
 
-    for (int index = maximum_voices; index < MAX_VOICES; index++)
+    for (int index = maximum_voices; index < voice_capacity; index++)
     {
-        voice_data[index].note_number = 255;
+        SetVoiceFree(index);
     }
 
     current_polyphony = 0;
@@ -1177,223 +1986,50 @@ void VLSG::SetMaximumVoices(int maximum_voices)
 /// <param name=""></param>
 void VLSG::ProcessMidiData(void)
 {
-    uint8_t midi_value;
-
-    while (true)
-    {
-        midi_value = GetValueFromMidiDataBuffer();
-        if (midi_value == 0xFF) break; // Stop processing
-
-        if (midi_value > 0xF7) continue; // Drop MIDI data, continue to next.
-
-        if (midi_value == 0xF7)
-        {
-            if (event_data[0] != 0xF0) continue;
-        }
-        else if ((midi_value & 0x80) != 0)
-        {
-            event_length = 0;
-            event_type = midi_value & 0xF0;
-            event_data[0] = midi_value;
-            channel_data_ptr = &(channel_data[midi_value & 0x0F]);
-            program_data_ptr = &(program_data[(midi_value & 0x0F) * 2]);
-
-            continue;
-        }
-        else
-        {
-            event_length++;
-            if (event_length >= 256) continue;
-
-            event_data[event_length] = midi_value;
-
-            if (event_data[0] == 0xF0) continue;
-
-            if ((event_type != 0xC0) && (event_type != 0xD0) && (event_length != 2)) continue;
-        }
-
-        switch (event_type)
-        {
-            case 0x80: // Note Off
-                NoteOff();
-                break;
-
-            case 0x90: // Note On
-                if (event_data[2] != 0)
-                {
-                    NoteOn(0);
-
-                    if (program_data_ptr->field_02 & 0x8000)
-                    {
-                        NoteOn(1);
-                    }
-                }
-                else
-                {
-                    NoteOff();
-                }
-                break;
-
-            case 0xB0: // Controller
-                ControlChange();
-                break;
-
-            case 0xC0: // Program Change
-                if ((event_data[0] & 0x0F) == DRUM_CHANNEL)
-                {
-                    int drum_kit_index;
-
-                    for (drum_kit_index = 0; drum_kit_index < 8; drum_kit_index++)
-                    {
-                        if (drum_kits[drum_kit_index] == event_data[1]) break;
-                    }
-                    if (drum_kit_index >= 8) break;
-
-                    channel_data_ptr->program_change = drum_kit_numbers[drum_kit_index];
-                    ProgramChange(program_data_ptr, drum_kit_numbers[drum_kit_index]);
-                }
-                else
-                {
-                    channel_data_ptr->program_change = event_data[1];
-                    ProgramChange(program_data_ptr, event_data[1]);
-                }
-                break;
-
-            case 0xD0: // Channel Pressure
-                channel_data_ptr->channel_pressure = event_data[1];
-                break;
-
-            case 0xE0: // Pitch Bend
-                channel_data_ptr->pitch_bend = event_data[1] + ((event_data[2] - 64) << 7);
-                break;
-
-            case 0xF0: // SysEx
-                SystemExclusive();
-                break;
-
-            default:
-                break;
-        }
-
-        event_length = 0;
-    }
+    ProcessMidiEvents(UINT32_MAX);
 
     system_time_1 = VLSG_GetTime();
 }
 
-uint8_t* VLSG::parseMidiMsg(iplug::IMidiMsg& msg)
+// The running status parser ProcessMidiData fed one byte at a time.
+inline void VLSG::ProcessMidiByte(uint8_t midi_value)
 {
-  iplug::IMidiMsg::EStatusMsg status = msg.StatusMsg();
-
-  // TODO port to msg.mData1/2 calls
-  static uint8_t data[12];
-  int length = 0;
-  auto sampOffset = msg.mOffset; // TODO how to use this?
-  uint8_t chan = msg.Channel() & 0xF;
-  uint8_t key = msg.NoteNumber() & 0x7F;
-  uint8_t vel = msg.Velocity() & 0x7F;
-  uint8_t prog = msg.Program() & 0x7F;
-
-  switch (status)
-  {
-  case iplug::IMidiMsg::kNoteOn:
-    data[0] = 0x90 | chan;
-    data[1] = key;
-    data[2] = vel;
-    length = 3;
-
-    //lsgWrite(data, length, sampOffset);
-
-    //printf("Note ON, channel:%d note:%d velocity:%d\n", chan, key, vel);
-    
-    break;
-
-  case iplug::IMidiMsg::kNoteOff:
-    data[0] = 0x80 | chan;
-    data[1] = key;
-    data[2] = vel;
-    length = 3;
-
-    //lsgWrite(data, length);
-
-    //printf("Note OFF, channel:%d note:%d velocity:%d\n", chan, key, vel);
-    
-    break;
-
-  case iplug::IMidiMsg::kControlChange: {
-    uint8_t cc = msg.ControlChangeIdx();
-    uint8_t ccVal = (uint8_t)(msg.ControlChange(msg.ControlChangeIdx()) * 127) & 0x7F; // assuming 7-bit
-    data[0] = 0xB0 | chan;
-    data[1] = cc & 0x7f;
-    data[2] = ccVal & 0x7f;
-
-    length = 3;
-
-    //lsgWrite(data, length);
-
-    //printf("Controller, channel:%d param:%d value:%d\n", chan, key, vel);
-    
-    break;
-  }
-
-  case iplug::IMidiMsg::kProgramChange:
-    data[0] = 0xC0 | chan;
-    data[1] = prog;
-    length = 2;
+    if (midi_value > 0xF7) return; // Drop MIDI data
 
-    //lsgWrite(data, length);
-
-    //printf("Program change: channel:%d value:%d\n", chan, prog);
-    
-    break;
+    if (midi_value == 0xF7)
+    {
+        if (event_data[0] != 0xF0) return;
+    }
+    else if ((midi_value & 0x80) != 0)
+    {
+        event_length = 0;
+        event_type = midi_value & 0xF0;
+        event_data[0] = midi_value;
 
-  case iplug::IMidiMsg::kChannelAftertouch: {
-    uint8_t aft = msg.ChannelAfterTouch() & 0x7F;
-    data[0] = 0xD0 | chan;
-    data[1] = aft;
-    length = 2;
+        return;
+    }
+    else
+    {
+        event_length++;
+        if (event_length >= 256) return;
 
-    //lsgWrite(data, length);
+        event_data[event_length] = midi_value;
 
-    //printf("Channel pressure: channel:%d value:%d\n", chan, aft);
-    
-    break;
-  }
+        if (event_data[0] == 0xF0) return;
 
-  case iplug::IMidiMsg::kPitchWheel: {
-    auto pbVal = msg.PitchWheel();
-    int pbValInt = (int)(pbVal * 8192) + 8192;
+        if ((event_type != 0xC0) && (event_type != 0xD0) && (event_length != 2)) return;
+    }
 
-    if (pbValInt > 16384) {
-      pbValInt = 16383;
+    if (event_type == 0xF0)
+    {
+        SystemExclusive();
     }
-    else if (pbValInt < 0) {
-      pbValInt = 0;
+    else
+    {
+        ProcessChannelMessage(event_data[0], event_data[1], event_data[2]);
     }
 
-    data[0] = 0xE0 | chan;
-    data[1] = (pbValInt) & 0x7f;
-    data[2] = (pbValInt >> 7) & 0x7f;
-    length = 3;
-
-    //lsgWrite(data, length);
-
-    //printf("Pitch bend: channel:%d value:%d\n", chan, pbVal);
-    
-    break;
-  }
-
-  default:
-    //msg.PrintMsg();
-    break;
-  }
-
-  // FF unused bytes
-  for (int i = length; i < 12; ++i) {
-    data[i] = 0xFF;
-  }
-
-  return data;
+    event_length = 0;
 }
 
 void VLSG::ProcessSysExDataVst(iplug::ISysEx& msg)
@@ -1423,8 +2059,6 @@ void VLSG::ProcessSysExDataVst(iplug::ISysEx& msg)
       event_length = 0;
       event_type = syx_value & 0xF0;
       event_data[0] = syx_value;
-      channel_data_ptr = &(channel_data[syx_value & 0x0F]);
-      program_data_ptr = &(program_data[(syx_value & 0x0F) * 2]);
 
       continue;
     }
@@ -1456,238 +2090,296 @@ void VLSG::ProcessSysExDataVst(iplug::ISysEx& msg)
   //system_time_1 = VLSG_GetTime();
 }
 
-inline void VLSG::ProcessMidiDataVst(iplug::IMidiMsg& msg)
+Voice_Data* VLSG::FindAvailableVoice(int32_t channel_num_2, int32_t note_number)
 {
-  uint8_t *midi_value_ptr = parseMidiMsg(msg);
-
-  while (true)
-  {
-    uint8_t midi_value = *midi_value_ptr;
-    ++midi_value_ptr;
-
-    if (midi_value == 0xFF) break; // Stop processing
-
-    if (midi_value > 0xF7) continue; // Drop MIDI data, continue to next.
+    int index1, index2;
+    uint32_t used;
+    int priority;
 
-    if (midi_value == 0xF7)
+    index1 = recent_voice_index + 1;
+    if (index1 >= maximum_polyphony)
     {
-      if (event_data[0] != 0xF0) continue;
+        index1 = 0;
     }
-    else if ((midi_value & 0x80) != 0)
-    {
-      event_length = 0;
-      event_type = midi_value & 0xF0;
-      event_data[0] = midi_value;
-      channel_data_ptr = &(channel_data[midi_value & 0x0F]);
-      program_data_ptr = &(program_data[(midi_value & 0x0F) * 2]);
 
-      continue;
-    }
-    else
+    index2 = FindFreeVoice(maximum_polyphony);
+    if (index2 < maximum_polyphony)
     {
-      event_length++;
-      if (event_length >= 32) continue;
-
-      event_data[event_length] = midi_value;
-
-      if (event_data[0] == 0xF0) continue;
-
-      if ((event_type != 0xC0) && (event_type != 0xD0) && (event_length != 2)) continue;
+        recent_voice_index = index2;
+        return &(voice_data[index2]);
     }
 
-    switch (event_type)
+    // Steal from the lowest priority bucket, round robin from the voice after
+    // the one allocated last.
+    for (used = priority_used; used != 0; used &= used - 1)
     {
-    case 0x80: // Note Off
-      NoteOff();
-      break;
-
-    case 0x90: // Note On
-      if (event_data[2] != 0)
-      {
-        NoteOn(0);
+        priority = lowest_set_bit(used);
 
-        if (program_data_ptr->field_02 & 0x8000)
+        index2 = next_set_bit(priority_voices[priority], index1, maximum_polyphony);
+        if (index2 >= maximum_polyphony)
         {
-          NoteOn(1);
+            index2 = next_set_bit(priority_voices[priority], 0, index1);
+            if (index2 >= index1) continue;
         }
-      }
-      else
-      {
-        NoteOff();
-      }
-      break;
 
-    case 0xB0: // Controller
-      ControlChange();
-      break;
+        recent_voice_index = index2;
+        return &(voice_data[index2]);
+    }
 
-    case 0xC0: // Program Change
-      if ((event_data[0] & 0x0F) == DRUM_CHANNEL)
-      {
-        int drum_kit_index;
+    recent_voice_index = index1;
+    return &(voice_data[index1]);
+}
+
+Voice_Data* VLSG::FindVoice(int32_t channel_num_2, int32_t note_number)
+{
+    int index, index2;
 
-        for (drum_kit_index = 0; drum_kit_index < 8; drum_kit_index++)
+    // The lowest held voice in the note's list, as the scan in slot order found.
+    index2 = maximum_polyphony;
+    for (index = note_voice_head[channel_num_2][note_number]; index >= 0; index = note_voice_next[index])
+    {
+        if (index < index2 && (voice_data[index].vflags & VFLAG_Value80) == 0)
         {
-          if (drum_kits[drum_kit_index] == event_data[1]) break;
+            index2 = index;
         }
-        if (drum_kit_index >= 8) break;
+    }
 
-        channel_data_ptr->program_change = drum_kit_numbers[drum_kit_index];
-        ProgramChange(program_data_ptr, drum_kit_numbers[drum_kit_index]);
-      }
-      else
-      {
-        channel_data_ptr->program_change = event_data[1];
-        ProgramChange(program_data_ptr, event_data[1]);
-      }
-      break;
+    return (index2 < maximum_polyphony) ? &(voice_data[index2]) : nullptr;
+}
 
-    case 0xD0: // Channel Pressure
-      channel_data_ptr->channel_pressure = event_data[1];
-      break;
+// A note on that an unreleased voice of the same part, note and velocity,
+// started at the same frame and with no other message on the channel since,
+// would only duplicate: StartPlayingVoice would set up the same voice and
+// ProcessPhase would step both alike. The voice plays one more note instead,
+// mixed at that many times its gain. The notes share its vibrato phase
+// (field_54), which a new voice otherwise takes over from its slot's last
+// one. Drum notes are not stacked, as each one also cuts off its exclusive
+// pair.
+bool VLSG::StackVoice(int32_t channel_num_2, int32_t note_number, int32_t velocity)
+{
+    int index;
 
-    case 0xE0: // Pitch Bend
-      channel_data_ptr->pitch_bend = event_data[1] + ((event_data[2] - 64) << 7);
-      break;
+    for (index = note_voice_head[channel_num_2][note_number]; index >= 0; index = note_voice_next[index])
+    {
+        if (index < maximum_polyphony &&
+            (voice_data[index].vflags & VFLAG_Value80) == 0 &&
+            voice_data[index].note_velocity == velocity &&
+            voice_data[index].start_frame == render_frame &&
+            voice_data[index].start_serial == channel_serial[channel_num_2 >> 1] &&
+            voice_mix.v_stack[index] < VOICE_STACK_LIMIT)
+        {
+            // A voice not stepped yet stays on top, see UpdateVoicePriority.
+            voice_mix.v_stack[index]++;
+            if (voice_priority[index] != VOICE_PRIORITIES - 1) UpdateVoicePriority(index);
+            return true;
+        }
+    }
 
-    default:
-      break;
+    return false;
+}
+
+// Takes one note off a stacked voice and returns a copy of the voice playing
+// just that note, for it to be released on its own. The copy goes into a free
+// slot of the same phase group, so ProcessPhaseGroups keeps stepping it in
+// time with the stack, else into any free slot, else into the slot of the
+// voice FindAvailableVoice would steal. Only with no other slot at all is the
+// whole stack returned, to be released. Unstacked voices are returned as they
+// are.
+Voice_Data* VLSG::UnstackVoice(Voice_Data *voice_data_ptr)
+{
+    int index, index2;
+
+    index = GetVoiceIndex(voice_data_ptr);
+    if (voice_mix.v_stack[index] <= 1) return voice_data_ptr;
+
+    index2 = FindUnstackVoice(index);
+    if (index2 >= maximum_polyphony) return voice_data_ptr;
+
+    if (voice_data[index2].note_number != 255)
+    {
+        VoiceSoundOff(&(voice_data[index2]));
+        SetVoiceFree(index2);
     }
 
-    event_length = 0;
-  }
+    voice_mix.v_stack[index]--;
+    if (voice_priority[index] != VOICE_PRIORITIES - 1) UpdateVoicePriority(index);
 
-  //system_time_1 = VLSG_GetTime();
+    CopyVoice(index2, index);
+    voice_mix.v_stack[index2] = 1;
+    SetVoiceActive(index2);
+    return &(voice_data[index2]);
 }
 
-Voice_Data* VLSG::FindAvailableVoice(int32_t channel_num_2, int32_t note_number)
+// The slot for UnstackVoice to copy voice index into, see there. Returns
+// maximum_polyphony if there is none.
+int VLSG::FindUnstackVoice(int index)
 {
-    int index1, index2, index3, index4;
+    uint32_t used;
+    int index2;
+    int priority;
 
-    index1 = recent_voice_index + 1;
-    if (index1 >= maximum_polyphony)
+    index2 = FindFreeVoice(maximum_polyphony, PHASE_GROUP_MASK(index % PHASE_GROUPS));
+    if (index2 < maximum_polyphony)
     {
-        index1 = 0;
+        return index2;
     }
 
-    for (index2 = 0; index2 < maximum_polyphony; index2++)
+    index2 = FindFreeVoice(maximum_polyphony);
+    if (index2 < maximum_polyphony)
     {
-        if (voice_data[index2].note_number == 255)
-        {
-            recent_voice_index = index2;
-            return &(voice_data[index2]);
-        }
+        return index2;
     }
 
-    index3 = index1;
-    do
+    for (used = priority_used; used != 0; used &= used - 1)
     {
-        if ((voice_data[index3].vflags & VFLAG_Value80) != 0)
-        {
-            recent_voice_index = index3;
-            return &(voice_data[index3]);
-        }
+        priority = lowest_set_bit(used);
 
-        index3++;
-        if (index3 >= maximum_polyphony)
+        index2 = next_set_bit(priority_voices[priority], 0, maximum_polyphony);
+        if (index2 == index)
         {
-            index3 = 0;
+            index2 = next_set_bit(priority_voices[priority], index + 1, maximum_polyphony);
         }
-    } while (index3 != index1);
-
-    index4 = index1;
-    do
-    {
-        if ((voice_data[index4].channel_num_2 & ~1) == (2 * DRUM_CHANNEL))
-        {
-            recent_voice_index = index4;
-            return &(voice_data[index4]);
-        }
-
-        index4++;
-        if (index4 >= maximum_polyphony)
+        if (index2 < maximum_polyphony)
         {
-            index4 = 0;
+            return index2;
         }
-    } while (index4 != index1);
+    }
 
-    recent_voice_index = index1;
-    return &(voice_data[index1]);
+    return maximum_polyphony;
 }
 
-Voice_Data* VLSG::FindVoice(int32_t channel_num_2, int32_t note_number)
+// Applies one channel voice message, from either the running status parser
+// or VLSG_BufferVst's typed events.
+void VLSG::ProcessChannelMessage(uint8_t status, uint8_t data1, uint8_t data2)
 {
-    int index;
+    Channel_Data *channel_data_ptr;
+    int32_t channel_num;
+    int drum_kit_index;
 
-    for (index = 0; index < maximum_polyphony; index++)
+    channel_num = status & 0x0F;
+    channel_data_ptr = &(channel_data[channel_num]);
+    if ((status & 0xE0) != 0x80)
     {
-        if (voice_data[index].note_number != 255)
-        {
-            if (voice_data[index].channel_num_2 == channel_num_2)
+        channel_serial[channel_num]++;
+    }
+
+    switch (status & 0xF0)
+    {
+        case 0x80: // Note Off
+            NoteOff(channel_num, data1);
+            break;
+
+        case 0x90: // Note On
+            if (data2 != 0)
             {
-                if (voice_data[index].note_number == note_number)
+                NoteOn(channel_num, 0, data1, data2);
+
+                if (program_data[channel_num * 2].field_02 & 0x8000)
                 {
-                    if ((voice_data[index].vflags & VFLAG_Value80) == 0)
-                    {
-                        return &(voice_data[index]);
-                    }
+                    NoteOn(channel_num, 1, data1, data2);
                 }
             }
-        }
+            else
+            {
+                NoteOff(channel_num, data1);
+            }
+            break;
 
-    }
+        case 0xB0: // Controller
+            ControlChange(channel_num, data1, data2);
+            break;
+
+        case 0xC0: // Program Change
+            if (channel_num == DRUM_CHANNEL)
+            {
+                for (drum_kit_index = 0; drum_kit_index < 8; drum_kit_index++)
+                {
+                    if (drum_kits[drum_kit_index] == data1) break;
+                }
+                if (drum_kit_index >= 8) break;
+
+                channel_data_ptr->program_change = drum_kit_numbers[drum_kit_index];
+                ProgramChange(&(program_data[channel_num * 2]), drum_kit_numbers[drum_kit_index]);
+            }
+            else
+            {
+                channel_data_ptr->program_change = data1;
+                ProgramChange(&(program_data[channel_num * 2]), data1);
+            }
+            break;
+
+        case 0xD0: // Channel Pressure
+            channel_data_ptr->channel_pressure = data1;
+            break;
+
+        case 0xE0: // Pitch Bend
+            channel_data_ptr->pitch_bend = data1 + ((data2 - 64) << 7);
+            break;
 
-    return nullptr;
+        default:
+            break;
+    }
 }
 
-void VLSG::NoteOff(void)
+void VLSG::NoteOff(int32_t channel_num, int32_t note_number)
 {
     Voice_Data *voice;
 
-    if ((event_data[0] & 0x0F) == DRUM_CHANNEL)
+    if (channel_num == DRUM_CHANNEL)
     {
-        if (channel_data_ptr->program_change != 7) return; // drum kit 49 (Orchestra Kit ?)
-        if (event_data[1] != 88) return; // Applause ?
+        if (channel_data[channel_num].program_change != 7) return; // drum kit 49 (Orchestra Kit ?)
+        if (note_number != 88) return; // Applause ?
     }
 
-    voice = FindVoice(2 * (event_data[0] & 0x0F), event_data[1]);
+    voice = FindVoice(2 * channel_num, note_number);
     if (voice != nullptr)
     {
-        VoiceNoteOff(voice);
+        VoiceNoteOff(UnstackVoice(voice));
     }
 
-    voice = FindVoice(2 * (event_data[0] & 0x0F) + 1, event_data[1]);
+    voice = FindVoice(2 * channel_num + 1, note_number);
     if (voice != nullptr)
     {
-        VoiceNoteOff(voice);
+        VoiceNoteOff(UnstackVoice(voice));
     }
 }
 
-void VLSG::NoteOn(int32_t part)
+void VLSG::NoteOn(int32_t channel_num, int32_t part, int32_t note_number, int32_t velocity)
 {
     Voice_Data *voice;
 
-    voice = FindAvailableVoice(part + 2 * (event_data[0] & 0x0F), event_data[1]);
+    if (voice_stacking && channel_num != DRUM_CHANNEL && StackVoice(part + 2 * channel_num, note_number, velocity))
+    {
+        return;
+    }
+
+    voice = FindAvailableVoice(part + 2 * channel_num, note_number);
     if (voice->note_number != 255)
     {
         VoiceSoundOff(voice);
+        SetVoiceFree(GetVoiceIndex(voice));
     }
 
-    voice->channel_num_2 = part + 2 * (event_data[0] & 0x0F);
-    voice->note_number = event_data[1];
-    voice->note_velocity = event_data[2];
-    StartPlayingVoice(voice, channel_data_ptr, &program_data_ptr[part]);
+    voice->channel_num_2 = part + 2 * channel_num;
+    voice->note_number = note_number;
+    SetVoiceActive(GetVoiceIndex(voice));
+    voice->note_velocity = velocity;
+    voice->start_frame = render_frame;
+    voice->start_serial = channel_serial[channel_num];
+    StartPlayingVoice(voice, &(channel_data[channel_num]), &(program_data[channel_num * 2 + part]));
 }
 
-void VLSG::ControlChange(void)
+void VLSG::ControlChange(int32_t channel_num, int32_t controller, int32_t value)
 {
-    switch (event_data[1])
+    Channel_Data *channel_data_ptr = &(channel_data[channel_num]);
+
+    switch (controller)
     {
         case 0x01: // Modulation
-            channel_data_ptr->modulation = event_data[2];
+            channel_data_ptr->modulation = value;
             break;
         case 0x06: // Data Entry (MSB)
-            channel_data_ptr->data_entry_MSB = event_data[2];
+            channel_data_ptr->data_entry_MSB = value;
             if (channel_data_ptr->parameter_number_MSB == 0)
             {
                 if (channel_data_ptr->parameter_number_LSB == 0) // Pitch bend range
@@ -1713,16 +2405,16 @@ void VLSG::ControlChange(void)
             }
             break;
         case 0x07: // Main Volume
-            channel_data_ptr->volume = event_data[2];
+            channel_data_ptr->volume = value;
             break;
         case 0x0A: // Pan
-            channel_data_ptr->pan = (2 * event_data[2]) - 128;
+            channel_data_ptr->pan = (2 * value) - 128;
             break;
         case 0x0B: // Expression Controller
-            channel_data_ptr->expression = event_data[2];
+            channel_data_ptr->expression = value;
             break;
         case 0x26: // Data Entry (LSB)
-            channel_data_ptr->data_entry_LSB = event_data[2];
+            channel_data_ptr->data_entry_LSB = value;
             if (channel_data_ptr->parameter_number_MSB == 0)
             {
                 if (channel_data_ptr->parameter_number_LSB == 0) // Pitch bend range
@@ -1746,31 +2438,31 @@ void VLSG::ControlChange(void)
             }
             break;
         case 0x40: // Damper pedal (sustain)
-            if (event_data[2] <= 63)
+            if (value <= 63)
             {
                 channel_data_ptr->chflags &= ~CHFLAG_Sustain;
-                ControllerSettingsOff(event_data[0] & 0x0F);
+                ControllerSettingsOff(channel_num);
             }
             else
             {
                 channel_data_ptr->chflags |= CHFLAG_Sustain;
-                ControllerSettingsOn(event_data[0] & 0x0F);
+                ControllerSettingsOn(channel_num);
             }
             break;
         case 0x42: // Sostenuto
-            if (event_data[2] <= 63)
+            if (value <= 63)
             {
                 channel_data_ptr->chflags &= ~CHFLAG_Sostenuto;
-                ControllerSettingsOff(event_data[0] & 0x0F);
+                ControllerSettingsOff(channel_num);
             }
             else
             {
                 channel_data_ptr->chflags |= CHFLAG_Sostenuto;
-                ControllerSettingsOn(event_data[0] & 0x0F);
+                ControllerSettingsOn(channel_num);
             }
           break;
         case 0x43: // Soft Pedal
-            if (event_data[2] <= 63)
+            if (value <= 63)
             {
                 channel_data_ptr->chflags &= ~CHFLAG_Soft;
             }
@@ -1780,26 +2472,26 @@ void VLSG::ControlChange(void)
             }
             break;
         case 0x62: // Non-Registered Parameter Number (LSB)
-            channel_data_ptr->parameter_number_LSB = event_data[2];
+            channel_data_ptr->parameter_number_LSB = value;
             break;
         case 0x63: // Non-Registered Parameter Number (MSB)
-            channel_data_ptr->parameter_number_MSB = event_data[2];
+            channel_data_ptr->parameter_number_MSB = value;
             break;
         case 0x64: // Registered Parameter Number (LSB)
-            channel_data_ptr->parameter_number_LSB = event_data[2];
+            channel_data_ptr->parameter_number_LSB = value;
             break;
         case 0x65: // Registered Parameter Number (MSB)
-            channel_data_ptr->parameter_number_MSB = event_data[2];
+            channel_data_ptr->parameter_number_MSB = value;
             break;
         case 0x78: // All sounds off
-            AllChannelSoundsOff(event_data[0] & 0x0F);
+            AllChannelSoundsOff(channel_num);
             break;
         case 0x79: // Reset all controllers
             ResetAllControllers(channel_data_ptr);
-            ControllerSettingsOff(event_data[0] & 0x0F);
+            ControllerSettingsOff(channel_num);
             break;
         case 0x7B: // All notes off
-            AllChannelNotesOff(event_data[0] & 0x0F);
+            AllChannelNotesOff(channel_num);
             break;
         default:
             break;
@@ -1810,6 +2502,11 @@ void VLSG::SystemExclusive(void)
 {
     int index;
 
+    for (index = 0; index < MIDI_CHANNELS; index++)
+    {
+        channel_serial[index]++;
+    }
+
     // GM reset / GS reset
     if ((event_data[0] == 0xF0 && event_data[1] == 0x7E && event_data[2] == 0x7F && event_data[3] == 0x09 && event_data[4] == 0x01) ||
         (event_data[0] == 0xF0 && event_data[1] == 0x41 && event_data[2] == 0x10 && event_data[3] == 0x42 && event_data[4] == 0x12 && event_data[5] == 0x40 && event_data[6] == 0x00 && event_data[7] == 0x7F && event_data[8] == 0x00 && event_data[9] == 0x41)
@@ -1833,41 +2530,32 @@ void VLSG::SystemExclusive(void)
     // change polyphony
     if (event_data[0] == 0xF0 && event_data[1] == 0x44 && event_data[2] == 0x0E && event_data[3] == 0x03)
     {
+        int32_t polyphony;
+
         switch (event_data[4])
         {
-            case 0x10:
-                SetMaximumVoices(24);
-                maximum_polyphony_new_value = 24;
-                return;
-
-            case 0x11:
-                SetMaximumVoices(32);
-                maximum_polyphony_new_value = 32;
-                return;
-
-            case 0x12:
-                SetMaximumVoices(48);
-                maximum_polyphony_new_value = 48;
-                return;
-
-            case 0x13:
-                SetMaximumVoices(64);
-                maximum_polyphony_new_value = 64;
-                return;
-
-            // Unofficial, experimental below
-            case 0x14:
-                SetMaximumVoices(128);
-                maximum_polyphony_new_value = 128;
-                return;
-
-            case 0x15:
-                SetMaximumVoices(256);
-                maximum_polyphony_new_value = 256;
-                return;
+            case 0x10: polyphony = 24; break;
+            case 0x11: polyphony = 32; break;
+            case 0x12: polyphony = 48; break;
+            case 0x13: polyphony = 64; break;
+
+            // Unofficial, experimental below; capped at the voice pool
+            case 0x14: polyphony = 128; break;
+            case 0x15: polyphony = 256; break;
+            case 0x16: polyphony = 512; break;
+            case 0x17: polyphony = 1024; break;
+            case 0x18: polyphony = 2048; break;
+            case 0x19: polyphony = 4096; break;
+
+            default: polyphony = 0; break;
+        }
 
-            default:
-                break;
+        if (polyphony != 0)
+        {
+            polyphony_requested = polyphony;
+            SetMaximumVoices(polyphony);
+            maximum_polyphony_new_value = maximum_polyphony;
+            return;
         }
     }
 
@@ -1955,484 +2643,1637 @@ bool VLSG::DeinitializeReverbBuffer(void)
     return true;
 }
 
-void VLSG::EnableReverb(void)
-{
-    is_reverb_enabled = 1;
-}
-
-void VLSG::DisableReverb(void)
-{
-    is_reverb_enabled = 0;
-#ifdef _MSC_VER
-    __stosd((unsigned long*)reverb_data_buffer, 0, sizeof(reverb_data_buffer) / 4);
-#else
-    memset(reverb_data_buffer, 0, sizeof(reverb_data_buffer));
-#endif
-}
-
-void VLSG::SetReverbShift(uint32_t shift)
+static inline int16_t clamp_sample(int32_t sample)
 {
-    reverb_shift = shift;
+    return (int16_t)((sample > 32767) ? 32767 : ((sample < -32768) ? -32768 : sample));
 }
 
-void VLSG::DefragmentVoices(void)
+// Decodes every wave reachable from a program into wave_cache_samples, so the
+// mixer reads plain int16 samples instead of unpacking the ROM's delta words.
+// A wave gets one run from its start and one from its loop start, each ending
+// in the two guard samples the decoder produced once it passed the wave end.
+// The same walk fills note_templates, so starting a voice and changing its
+// envelope stage need no bank header lookups.
+// With a cache file set, the tables are mapped from it when it was written for
+// the same ROM, and written to it after building them otherwise.
+bool VLSG::InitializeWaveCache(void)
 {
-    int index1, index2;
+    uint64_t rom_checksum;
 
-    index2 = 0;
-    for (index1 = 0; index1 < maximum_polyphony; index1++)
+    if (romsxgm_ptr == nullptr)
     {
-        if (voice_data[index1].note_number != 255) continue;
-
-        if (index2 < index1)
-        {
-            index2 = index1;
-        }
-        while (voice_data[index2].note_number == 255)
-        {
-            index2++;
-            if (index2 >= maximum_polyphony) return;
-        }
-
-        voice_data[index1] = voice_data[index2];
-        voice_data[index2].note_number = 255;
+        return false;
     }
-}
-
-inline void VLSG::GenerateOutputDataVst(double **output_ptr, uint32_t offset1, uint32_t offset2)
-{
-  int index1, max_active_index;
-  unsigned int index2;
-  int32_t left;
-  int32_t right;
-  uint32_t value1;
-  uint32_t value2;
-  uint32_t value3;
-  const uint8_t* rom_ptr;
-  int32_t value4;
-  int32_t value5;
-  int32_t value6;
-  int32_t value7;
-  int32_t reverb_value1;
-  int32_t reverb_value2;
-  int32_t reverb_value3;
-  int32_t reverb_value4;
-
-  static int callCount = 0;
-
-  if (callCount == 0) {
-    DefragmentVoices();
-  }
-  ++callCount;
-  if (callCount >= output_size_para) {
-    callCount = 0;
-  }
 
-  max_active_index = -1;
-  for (index1 = 0; index1 < maximum_polyphony; index1++)
-  {
-    if (voice_data[index1].note_number != 255)
+    // The cache only depends on the ROM, so restarting playback keeps it.
+    if (wave_cache_rom == romsxgm_ptr)
     {
-      max_active_index = index1;
+        return true;
     }
-  }
 
-  for (index2 = offset1; index2 < offset2; index2++)
-  {
-    left = 0;
-    right = 0;
-    for (index1 = 0; index1 <= max_active_index; index1++)
-    {
-      value1 = voice_data[index1].wv_end;
-      value2 = voice_data[index1].wv_fpos >> 10;
-      if (value2 >= value1)
-      {
-        if (value1 == voice_data[index1].wv_start)
-        {
-          voice_data[index1].note_number = 255;
-          voice_data[index1].field_28 = 0;
-          continue;
-        }
-
-        value3 = (value2 + (voice_data[index1].wv_start & 1) - value1) & ~1;
-        if (value3 >= 10)
-        {
-          voice_data[index1].wv_fpos += (8 - value3) << 10;
-          value3 = 8;
-        }
+    UnmapWaveCacheFile();
+    rom_checksum = wave_cache_path.empty() ? 0 : GetRomChecksum();
 
-        rom_ptr = &(romsxgm_ptr[voice_data[index1].wv_end]);
-        value4 = ((int32_t)(READ_LE_UINT16(&(rom_ptr[value3])) << 17)) >> 17;
-        voice_data[index1].wv_un3_hi = (((int32_t)READ_LE_UINT16(&(rom_ptr[10]))) >> (value3 + (value3 >> 1))) & 7;
+    if (wave_cache_path.empty() || !MapWaveCacheFile(rom_checksum))
+    {
+        BuildWaveCache();
 
-        voice_data[index1].field_0C[1] = value4;
-        voice_data[index1].field_0C[0] = value4 - ((((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_start & ~1])) << 16)) >> 25) << voice_data[index1].wv_un3_hi);
+        wave_cache.samples = wave_cache_samples.data();
+        wave_cache.entries = wave_cache_index.data();
+        wave_cache.entry_count = (uint32_t)wave_cache_index.size();
+        wave_cache.note_templates = note_templates.data();
+        wave_cache.flags_segments = flags_segments.data();
+        wave_cache.flags2_segments = flags2_segments.data();
 
-        voice_data[index1].wv_fpos += (voice_data[index1].wv_start - voice_data[index1].wv_end) << 10;
-        value2 = voice_data[index1].wv_fpos >> 10;
-        voice_data[index1].wv_pos = (value2 & ~1) + 2;
-        value5 = READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_pos]));
-        voice_data[index1].wv_un3_hi += dword_C00342C0[value5 & 3];
-        voice_data[index1].field_0C[2] = voice_data[index1].field_0C[1] + ((((int32_t)(value5 << 23)) >> 25) << voice_data[index1].wv_un3_hi);
-        voice_data[index1].field_0C[3] = voice_data[index1].field_0C[2] + ((((int32_t)(value5 << 16)) >> 25) << voice_data[index1].wv_un3_hi);
-      }
-      else
-      {
-        while (voice_data[index1].wv_pos <= (value2 & ~1))
+        if (!wave_cache_path.empty())
         {
-          voice_data[index1].wv_pos += 2;
-          if (voice_data[index1].wv_end <= voice_data[index1].wv_pos)
-          {
-            voice_data[index1].field_0C[0] = voice_data[index1].field_0C[2];
-            voice_data[index1].field_0C[1] = voice_data[index1].field_0C[3];
-
-            if ((voice_data[index1].wv_start & 1) != 0)
-            {
-              rom_ptr = &(romsxgm_ptr[voice_data[index1].wv_end]);
-              value4 = ((int32_t)(READ_LE_UINT16(rom_ptr) << 17)) >> 17;
-              voice_data[index1].wv_un3_hi = rom_ptr[10] & 7;
-
-              voice_data[index1].field_0C[2] = value4;
-            }
-            else
-            {
-              rom_ptr = &(romsxgm_ptr[voice_data[index1].wv_end]);
-              value4 = ((int32_t)(READ_LE_UINT16(rom_ptr) << 17)) >> 17;
-              voice_data[index1].wv_un3_hi = rom_ptr[10] & 7;
-
-              voice_data[index1].field_0C[3] = value4;
-              voice_data[index1].field_0C[2] = value4 - ((((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_start & ~1])) << 16)) >> 25) << voice_data[index1].wv_un3_hi);
-            }
-          }
-          else
-          {
-            value5 = READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_pos]));
-            voice_data[index1].field_0C[0] = voice_data[index1].field_0C[2];
-            voice_data[index1].field_0C[1] = voice_data[index1].field_0C[3];
-            voice_data[index1].wv_un3_hi += dword_C00342C0[value5 & 3];
-            voice_data[index1].field_0C[2] = voice_data[index1].field_0C[1] + ((((int32_t)(value5 << 23)) >> 25) << voice_data[index1].wv_un3_hi);
-            voice_data[index1].field_0C[3] = voice_data[index1].field_0C[2] + ((((int32_t)(value5 << 16)) >> 25) << voice_data[index1].wv_un3_hi);
-          }
+            WriteWaveCacheFile(rom_checksum);
         }
-      }
-
-      value7 = voice_data[index1].field_0C[value2 & 1];
-      value7 += ((int32_t)((voice_data[index1].field_0C[(value2 & 1) + 1] - value7) * (voice_data[index1].wv_fpos & 0x3FF))) >> 10;
-      value6 = ((int32_t)(15 * voice_data[index1].field_2C + voice_data[index1].field_38)) >> 4;
-      value7 = ((int32_t)(value7 * value6)) >> 12;
-
-      voice_data[index1].field_2C = value6;
-      voice_data[index1].wv_fpos += voice_data[index1].v_freq;
-      left += value7 >> voice_data[index1].field_30;
-      right += value7 >> voice_data[index1].field_34;
-    }
-
-    if (is_reverb_enabled == 1)
-    {
-      reverb_value1 = (left + right) >> 3;
-
-      reverb_value2 = reverb_data_ptr[reverb_data_index & 0x7FFF];
-      reverb_data_ptr[(reverb_data_index + 500) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-      reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-      reverb_value2 = reverb_data_ptr[(reverb_data_index + 501) & 0x7FFF];
-      reverb_data_ptr[(reverb_data_index + 826) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-      reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-      reverb_value2 = reverb_data_ptr[(reverb_data_index + 827) & 0x7FFF];
-      reverb_data_ptr[(reverb_data_index + 1038) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-      reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-      reverb_value2 = reverb_data_ptr[(reverb_data_index + 1039) & 0x7FFF];
-      reverb_data_ptr[(reverb_data_index + 1176) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-      reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-      reverb_value3 = reverb_value1 >> 1;
-
-      reverb_value4 = reverb_data_ptr[(reverb_data_index + 1177) & 0x7FFF] - ((96 * reverb_data_ptr[(reverb_data_index + 1179) & 0x7FFF]) >> 8);
-      reverb_data_ptr[(reverb_data_index + 1178) & 0x7FFF] = reverb_value4 >> 3;
-      reverb_data_ptr[(reverb_data_index + 3177) & 0x7FFF] = reverb_value4 + reverb_value3;
-
-      reverb_value4 = reverb_data_ptr[(reverb_data_index + 3178) & 0x7FFF] - ((97 * reverb_data_ptr[(reverb_data_index + 3180) & 0x7FFF]) >> 8);
-      reverb_data_ptr[(reverb_data_index + 3179) & 0x7FFF] = reverb_value4 >> 3;
-      reverb_data_ptr[(reverb_data_index + 5118) & 0x7FFF] = reverb_value4 + reverb_value3;
-
-      left += (reverb_data_ptr[(reverb_data_index + 1179) & 0x7FFF] + reverb_data_ptr[(reverb_data_index + 3335) & 0x7FFF]) >> reverb_shift;
-      right += (reverb_data_ptr[(reverb_data_index + 1339) & 0x7FFF] + reverb_data_ptr[(reverb_data_index + 3180) & 0x7FFF]) >> reverb_shift;
-
-      reverb_data_index = (reverb_data_index + 1) & 0x7FFF;
     }
-    
-    // Floating point supports going beyond clipping so F IT.
-    //if (left > 32767)
-    //{
-    //  left = 32767;
-    //}
-    //else if (left <= -32767)
-    //{
-    //  left = -32767;
-    //}
-
-    //if (right > 32767)
-    //{
-    //  right = 32767;
-    //}
-    //else if (right <= -32767)
-    //{
-    //  right = -32767;
-    //}
 
-    (output_ptr)[0][index2] = left / 32768.0;
-    (output_ptr)[1][index2] = right / 32768.0;
-  }
+    wave_cache_rom = romsxgm_ptr;
+    return true;
 }
 
-void VLSG::GenerateOutputData(uint8_t *output_ptr, uint32_t offset1, uint32_t offset2)
+void VLSG::BuildWaveCache(void)
 {
-    int index1, max_active_index;
-    unsigned int index2;
-    int32_t left;
-    int32_t right;
-    uint32_t value1;
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t>, uint32_t> first_passes;
+    std::map<std::tuple<uint32_t, uint32_t>, uint32_t> loop_passes;
+    Wave_Cache_Entry entry;
+    Wave_Cache_Entry *wave;
+    Note_Template *note_template;
+    std::map<uint32_t, uint32_t> flags_rows;
+    std::map<uint32_t, uint32_t> flags2_rows;
+    uint32_t program_offset;
+    uint32_t wave_offset;
+    uint32_t start;
+    uint32_t end;
+    uint32_t loop_start;
+    uint32_t shift;
+    uint32_t offset1;
+    int32_t value1;
     uint32_t value2;
-    uint32_t value3;
-    const uint8_t *rom_ptr;
-    int32_t value4;
-    int32_t value5;
-    int32_t value6;
-    int32_t value7;
-    int32_t reverb_value1;
-    int32_t reverb_value2;
-    int32_t reverb_value3;
-    int32_t reverb_value4;
-
-    DefragmentVoices();
-
-    max_active_index = -1;
-    for (index1 = 0; index1 < maximum_polyphony; index1++)
+    uint16_t field_00;
+    uint16_t field_02;
+    uint16_t field_12;
+    uint16_t field_14;
+    int program_number, part, note_number, wave_index;
+
+    // Two silent samples at the front for voices that have nothing to play.
+    wave_cache_samples.assign(2, 0);
+    wave_cache_index.clear();
+    note_templates.resize(136 * 2 * 128);
+    flags_segments.clear();
+    flags2_segments.clear();
+
+    // Melodic programs 0-127 and drum sets 128-135, both parts, every note
+    // voice_get_index can return (it folds melodic notes into 12-108).
+    for (program_number = 0; program_number < 136; program_number++)
     {
-        if (voice_data[index1].note_number != 255)
-        {
-            max_active_index = index1;
-        }
-    }
+        program_offset = rom_change_bank(1, rom_read_word_at(rom_change_bank(19, 0) + 2 * program_number));
 
-    for (index2 = offset1; index2 < offset2; index2++)
-    {
-        left = 0;
-        right = 0;
-        for (index1 = 0; index1 <= max_active_index; index1++)
+        for (part = 0; part < 2; part++)
         {
-            value1 = voice_data[index1].wv_end;
-            value2 = voice_data[index1].wv_fpos >> 10;
-            if (value2 >= value1)
+            field_00 = (uint16_t)rom_read_word_at(program_offset + 28 * part);
+            field_02 = (uint16_t)rom_read_word_at(program_offset + 28 * part + 2);
+            field_12 = (uint16_t)rom_read_word_at(program_offset + 28 * part + 18);  // Program_Data.index
+            field_14 = (uint16_t)rom_read_word_at(program_offset + 28 * part + 20);
+
+            for (note_number = 0; note_number < 128; note_number++)
             {
-                if (value1 == voice_data[index1].wv_start)
+                // The lookups StartPlayingVoice, voice_set_flags and
+                // voice_set_flags2 made through bank 3.
+                note_template = &(note_templates[(((2 * program_number) + part) << 7) + note_number]);
+                note_template->wave_index = (field_02 & 0xFFF) + rom_read_word_at(rom_change_bank(3, field_00 >> 8) + 2 * note_number);
+                note_template->flags_row = AddFlagsRow(flags_rows, rom_change_bank(10, (field_12 >> 8) + rom_read_word_at(rom_change_bank(3, field_12 & 0xFF) + 2 * note_number)));
+                note_template->flags2_row = AddFlags2Row(flags2_rows, rom_change_bank(11, (field_14 >> 8) + rom_read_word_at(rom_change_bank(3, field_14 & 0xFF) + 2 * note_number)));
+
+                wave_index = note_template->wave_index;
+                if (wave_index < 0) continue;
+
+                if ((uint32_t)wave_index >= wave_cache_index.size())
+                {
+                    memset(&entry, 0, sizeof(entry));
+                    wave_cache_index.resize(wave_index + 1, entry);
+                }
+                else if (wave_cache_index[wave_index].valid)
                 {
-                    voice_data[index1].note_number = 255;
-                    voice_data[index1].field_28 = 0;
                     continue;
                 }
 
-                value3 = (value2 + (voice_data[index1].wv_start & 1) - value1) & ~1;
-                if (value3 >= 10)
+                // Same fields StartPlayingVoice read from the bank 2 entry.
+                wave_offset = rom_change_bank(2, wave_index);
+                if (wave_offset + 16 > ROM_SIZE) continue;
+
+                start = (READ_LE_UINT16(&(romsxgm_ptr[wave_offset])) | (romsxgm_ptr[wave_offset + 2] << 16)) & 0x3FFFFF;
+                end = (romsxgm_ptr[wave_offset + 3] | (READ_LE_UINT16(&(romsxgm_ptr[wave_offset + 4])) << 8)) & 0x3FFFFF;
+                loop_start = (READ_LE_UINT16(&(romsxgm_ptr[wave_offset + 8])) | (romsxgm_ptr[wave_offset + 10] << 16)) & 0x3FFFFF;
+                shift = romsxgm_ptr[wave_offset + 15];
+
+                wave = &(wave_cache_index[wave_index]);
+                wave->start = start;
+                wave->end = end;
+                wave->loop_start = loop_start;
+                wave->wv_un1 = READ_LE_UINT16(&(romsxgm_ptr[wave_offset + 10]));
+                wave->base_freq = (int16_t)READ_LE_UINT16(&(romsxgm_ptr[wave_offset + 12]));
+                wave->wv_un3_lo = romsxgm_ptr[wave_offset + 14];
+
+                // Waves running past the ROM or looping forwards are left invalid
+                // and started silent.
+                if ((start >= end) || (loop_start > end) || (end + 12 > ROM_SIZE)) continue;
+
+                std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> first_key(start & ~1, end, loop_start, shift);
+                auto first_pass = first_passes.find(first_key);
+                if (first_pass == first_passes.end())
                 {
-                    voice_data[index1].wv_fpos += (8 - value3) << 10;
-                    value3 = 8;
+                    first_pass = first_passes.emplace(first_key, DecodeWavePass(start & ~1, end, loop_start, 0, shift)).first;
                 }
+                wave = &(wave_cache_index[wave_index]);
+                wave->first_bias = first_pass->second - (start & ~1);
+                wave->loop_bias = 0;
 
-                rom_ptr = &(romsxgm_ptr[voice_data[index1].wv_end]);
-                value4 = ((int32_t)(READ_LE_UINT16(&(rom_ptr[value3])) << 17)) >> 17;
-                voice_data[index1].wv_un3_hi = (((int32_t)READ_LE_UINT16(&(rom_ptr[10]))) >> (value3 + (value3 >> 1))) & 7;
-
-                voice_data[index1].field_0C[1] = value4;
-                voice_data[index1].field_0C[0] = value4 - ((((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_start & ~1])) << 16)) >> 25) << voice_data[index1].wv_un3_hi);
-
-                voice_data[index1].wv_fpos += (voice_data[index1].wv_start - voice_data[index1].wv_end) << 10;
-                value2 = voice_data[index1].wv_fpos >> 10;
-                voice_data[index1].wv_pos = (value2 & ~1) + 2;
-                value5 = READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_pos]));
-                voice_data[index1].wv_un3_hi += dword_C00342C0[value5 & 3];
-                voice_data[index1].field_0C[2] = voice_data[index1].field_0C[1] + ((((int32_t)(value5 << 23)) >> 25) << voice_data[index1].wv_un3_hi);
-                voice_data[index1].field_0C[3] = voice_data[index1].field_0C[2] + ((((int32_t)(value5 << 16)) >> 25) << voice_data[index1].wv_un3_hi);
-            }
-            else
-            {
-                while (voice_data[index1].wv_pos <= (value2 & ~1))
+                if (loop_start != end)
                 {
-                    voice_data[index1].wv_pos += 2;
-                    if (voice_data[index1].wv_end <= voice_data[index1].wv_pos)
-                    {
-                        voice_data[index1].field_0C[0] = voice_data[index1].field_0C[2];
-                        voice_data[index1].field_0C[1] = voice_data[index1].field_0C[3];
-
-                        if ((voice_data[index1].wv_start & 1) != 0)
-                        {
-                            rom_ptr = &(romsxgm_ptr[voice_data[index1].wv_end]);
-                            value4 = ((int32_t)(READ_LE_UINT16(rom_ptr) << 17)) >> 17;
-                            voice_data[index1].wv_un3_hi = rom_ptr[10] & 7;
-
-                            voice_data[index1].field_0C[2] = value4;
-                        }
-                        else
-                        {
-                            rom_ptr = &(romsxgm_ptr[voice_data[index1].wv_end]);
-                            value4 = ((int32_t)(READ_LE_UINT16(rom_ptr) << 17)) >> 17;
-                            voice_data[index1].wv_un3_hi = rom_ptr[10] & 7;
-
-                            voice_data[index1].field_0C[3] = value4;
-                            voice_data[index1].field_0C[2] = value4 - ((((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_start & ~1])) << 16)) >> 25) << voice_data[index1].wv_un3_hi);
-                        }
-                    }
-                    else
+                    std::tuple<uint32_t, uint32_t> loop_key(loop_start, end);
+                    auto loop_pass = loop_passes.find(loop_key);
+                    if (loop_pass == loop_passes.end())
                     {
-                        value5 = READ_LE_UINT16(&(romsxgm_ptr[voice_data[index1].wv_pos]));
-                        voice_data[index1].field_0C[0] = voice_data[index1].field_0C[2];
-                        voice_data[index1].field_0C[1] = voice_data[index1].field_0C[3];
-                        voice_data[index1].wv_un3_hi += dword_C00342C0[value5 & 3];
-                        voice_data[index1].field_0C[2] = voice_data[index1].field_0C[1] + ((((int32_t)(value5 << 23)) >> 25) << voice_data[index1].wv_un3_hi);
-                        voice_data[index1].field_0C[3] = voice_data[index1].field_0C[2] + ((((int32_t)(value5 << 16)) >> 25) << voice_data[index1].wv_un3_hi);
+                        // Looping restarts the decoder from the sample and shift
+                        // stored after the wave end, as the wrap in the mixer did.
+                        value1 = ((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[end])) << 17)) >> 17;
+                        value2 = romsxgm_ptr[end + 10] & 7;
+
+                        offset1 = (uint32_t)wave_cache_samples.size();
+                        wave_cache_samples.push_back(clamp_sample(value1 - ((((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[loop_start & ~1])) << 16)) >> 25) << value2)));
+                        wave_cache_samples.push_back(clamp_sample(value1));
+                        DecodeWavePass((loop_start & ~1) + 2, end, loop_start, value1, value2);
+
+                        loop_pass = loop_passes.emplace(loop_key, offset1).first;
                     }
+                    wave->loop_bias = loop_pass->second - (loop_start & ~1);
                 }
-            }
 
-            value7 = voice_data[index1].field_0C[value2 & 1];
-            value7 += ((int32_t)((voice_data[index1].field_0C[(value2 & 1) + 1] - value7) * (voice_data[index1].wv_fpos & 0x3FF))) >> 10;
-            value6 = ((int32_t)(15 * voice_data[index1].field_2C + voice_data[index1].field_38)) >> 4;
-            value7 = ((int32_t)(value7 * value6)) >> 12;
-
-            voice_data[index1].field_2C = value6;
-            voice_data[index1].wv_fpos += voice_data[index1].v_freq;
-            left += value7 >> voice_data[index1].field_30;
-            right += value7 >> voice_data[index1].field_34;
+                wave->valid = true;
+            }
         }
+    }
+}
 
-        if (is_reverb_enabled == 1)
-        {
-            reverb_value1 = (left + right) >> 3;
-
-            reverb_value2 = reverb_data_ptr[reverb_data_index & 0x7FFF];
-            reverb_data_ptr[(reverb_data_index + 500) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-            reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-            reverb_value2 = reverb_data_ptr[(reverb_data_index + 501) & 0x7FFF];
-            reverb_data_ptr[(reverb_data_index + 826) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-            reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-            reverb_value2 = reverb_data_ptr[(reverb_data_index + 827) & 0x7FFF];
-            reverb_data_ptr[(reverb_data_index + 1038) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-            reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
-
-            reverb_value2 = reverb_data_ptr[(reverb_data_index + 1039) & 0x7FFF];
-            reverb_data_ptr[(reverb_data_index + 1176) & 0x7FFF] = reverb_value1 - (reverb_value2 >> 1);
-            reverb_value1 = (reverb_value1 >> 1) + reverb_value2;
+constexpr bool VLSG::EMPTY_DeinitializeWaveCache(void)
+{
+    return true;
+}
 
-            reverb_value3 = reverb_value1 >> 1;
+uint64_t VLSG::GetRomChecksum(void) const
+{
+    uint64_t checksum;
+    uint64_t value1;
+    uint32_t offset1;
 
-            reverb_value4 = reverb_data_ptr[(reverb_data_index + 1177) & 0x7FFF] - ((96 * reverb_data_ptr[(reverb_data_index + 1179) & 0x7FFF]) >> 8);
-            reverb_data_ptr[(reverb_data_index + 1178) & 0x7FFF] = reverb_value4 >> 3;
-            reverb_data_ptr[(reverb_data_index + 3177) & 0x7FFF] = reverb_value4 + reverb_value3;
+    checksum = 14695981039346656037ull;
+    for (offset1 = 0; offset1 < ROM_SIZE; offset1 += 8)
+    {
+        memcpy(&value1, &(romsxgm_ptr[offset1]), 8);
+        checksum = (checksum ^ value1) * 1099511628211ull;
+        checksum ^= checksum >> 32;
+    }
 
-            reverb_value4 = reverb_data_ptr[(reverb_data_index + 3178) & 0x7FFF] - ((97 * reverb_data_ptr[(reverb_data_index + 3180) & 0x7FFF]) >> 8);
-            reverb_data_ptr[(reverb_data_index + 3179) & 0x7FFF] = reverb_value4 >> 3;
-            reverb_data_ptr[(reverb_data_index + 5118) & 0x7FFF] = reverb_value4 + reverb_value3;
+    return checksum;
+}
 
-            left += (reverb_data_ptr[(reverb_data_index + 1179) & 0x7FFF] + reverb_data_ptr[(reverb_data_index + 3335) & 0x7FFF]) >> reverb_shift;
-            right += (reverb_data_ptr[(reverb_data_index + 1339) & 0x7FFF] + reverb_data_ptr[(reverb_data_index + 3180) & 0x7FFF]) >> reverb_shift;
+static inline uint32_t wave_cache_file_align(uint64_t offset)
+{
+    return (uint32_t)((offset + 63) & ~(uint64_t)63);
+}
 
-            reverb_data_index = (reverb_data_index + 1) & 0x7FFF;
-        }
+// Places the tables of a cache file, see Wave_Cache_File_Header, and returns
+// its size, or 0 if it would not fit in 1 GB.
+static uint32_t wave_cache_file_layout(const Wave_Cache_File_Header *header, uint32_t *offsets)
+{
+    uint64_t offset1;
+
+    offset1 = wave_cache_file_align(sizeof(Wave_Cache_File_Header));
+    offsets[0] = (uint32_t)offset1;
+    offset1 = wave_cache_file_align(offset1 + (uint64_t)header->sample_count * sizeof(int16_t));
+    offsets[1] = (uint32_t)offset1;
+    offset1 = wave_cache_file_align(offset1 + (uint64_t)header->entry_count * sizeof(Wave_Cache_Entry));
+    offsets[2] = (uint32_t)offset1;
+    offset1 = wave_cache_file_align(offset1 + (uint64_t)header->note_template_count * sizeof(Note_Template));
+    offsets[3] = (uint32_t)offset1;
+    offset1 = wave_cache_file_align(offset1 + (uint64_t)header->flags_segment_count * sizeof(Flags_Segment));
+    offsets[4] = (uint32_t)offset1;
+    offset1 = offset1 + (uint64_t)header->flags2_segment_count * sizeof(Flags2_Segment);
+
+    return (offset1 > (1u << 30)) ? 0 : (uint32_t)offset1;
+}
 
-        if (left > 32767)
-        {
-            left = 32767;
+// Points wave_cache into the cache file if it holds the tables for this ROM.
+// Anything that does not match what this build would write, or indexes past
+// the tables, makes it fall back to building them.
+bool VLSG::MapWaveCacheFile(uint64_t rom_checksum)
+{
+    const Wave_Cache_File_Header *header;
+    const Wave_Cache_Entry *wave;
+    const Note_Template *note_template;
+    const uint8_t *data;
+    uint32_t offsets[5];
+    uint32_t index1;
+    size_t size;
+    void *mem;
+
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+    LARGE_INTEGER file_size;
+
+    file = CreateFileA(wave_cache_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    if (!GetFileSizeEx(file, &file_size) || (file_size.QuadPart < (LONGLONG)sizeof(Wave_Cache_File_Header)) || (file_size.QuadPart > (1 << 30)))
+    {
+        CloseHandle(file);
+        return false;
+    }
+    size = (size_t)file_size.QuadPart;
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+    mem = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mapping);
+    if (mem == nullptr)
+    {
+        return false;
+    }
+#else
+    struct stat st;
+    int fd;
+
+    fd = open(wave_cache_path.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(Wave_Cache_File_Header)) || (st.st_size > (1 << 30)))
+    {
+        close(fd);
+        return false;
+    }
+    // Another user able to truncate the file would crash the mixer on a fault.
+    if ((st.st_uid != geteuid()) || ((st.st_mode & (S_IWGRP | S_IWOTH)) != 0))
+    {
+        close(fd);
+        return false;
+    }
+    size = (size_t)st.st_size;
+    mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        return false;
+    }
+#endif
+
+    wave_cache_file_data = mem;
+    wave_cache_file_size = size;
+    data = (const uint8_t *)mem;
+    header = (const Wave_Cache_File_Header *)data;
+
+    if ((header->magic != WAVE_CACHE_FILE_MAGIC) ||
+        (header->version != WAVE_CACHE_FILE_VERSION) ||
+        (header->rom_checksum != rom_checksum) ||
+        (header->struct_sizes[0] != sizeof(Wave_Cache_Entry)) ||
+        (header->struct_sizes[1] != sizeof(Note_Template)) ||
+        (header->struct_sizes[2] != sizeof(Flags_Segment)) ||
+        (header->struct_sizes[3] != sizeof(Flags2_Segment)) ||
+        (header->note_template_count != 136 * 2 * 128) ||
+        (header->file_size != size) ||
+        (wave_cache_file_layout(header, offsets) != size))
+    {
+        UnmapWaveCacheFile();
+        return false;
+    }
+
+    wave_cache.samples = (const int16_t *)&(data[offsets[0]]);
+    wave_cache.entries = (const Wave_Cache_Entry *)&(data[offsets[1]]);
+    wave_cache.entry_count = header->entry_count;
+    wave_cache.note_templates = (const Note_Template *)&(data[offsets[2]]);
+    wave_cache.flags_segments = (const Flags_Segment *)&(data[offsets[3]]);
+    wave_cache.flags2_segments = (const Flags2_Segment *)&(data[offsets[4]]);
+
+    for (index1 = 0; index1 < header->note_template_count; index1++)
+    {
+        note_template = &(wave_cache.note_templates[index1]);
+        if (((note_template->wave_index >= 0) && ((uint32_t)note_template->wave_index >= header->entry_count)) ||
+            ((uint64_t)note_template->flags_row + ENVELOPE_ROW_SEGMENTS > header->flags_segment_count) ||
+            ((uint64_t)note_template->flags2_row + ENVELOPE_ROW_SEGMENTS > header->flags2_segment_count))
+        {
+            UnmapWaveCacheFile();
+            return false;
+        }
+    }
+
+    // The mixer reads up to the two guard samples after a wave end.
+    for (index1 = 0; index1 < header->entry_count; index1++)
+    {
+        wave = &(wave_cache.entries[index1]);
+        if (wave->valid &&
+            (((uint64_t)(uint32_t)(wave->first_bias + wave->end) + 2 > header->sample_count) ||
+             ((wave->loop_start != wave->end) && ((uint64_t)(uint32_t)(wave->loop_bias + wave->end) + 2 > header->sample_count))))
+        {
+            UnmapWaveCacheFile();
+            return false;
+        }
+    }
+
+    // Nothing reads the built tables any more.
+    std::vector<int16_t>().swap(wave_cache_samples);
+    std::vector<Wave_Cache_Entry>().swap(wave_cache_index);
+    std::vector<Note_Template>().swap(note_templates);
+    std::vector<Flags_Segment>().swap(flags_segments);
+    std::vector<Flags2_Segment>().swap(flags2_segments);
+    return true;
+}
+
+void VLSG::UnmapWaveCacheFile(void)
+{
+    if (wave_cache_file_data == nullptr)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    UnmapViewOfFile(wave_cache_file_data);
+#else
+    munmap(wave_cache_file_data, wave_cache_file_size);
+#endif
+    wave_cache_file_data = nullptr;
+    wave_cache_file_size = 0;
+    memset(&wave_cache, 0, sizeof(wave_cache));
+}
+
+// Writes the built tables to a newly created file of its own first and renames
+// that over the cache file, so other processes never map half a file. The
+// temporary file is never one that already existed, which could be a link to
+// somewhere else. Failing to write only means the next start builds the
+// tables again.
+void VLSG::WriteWaveCacheFile(uint64_t rom_checksum) const
+{
+    Wave_Cache_File_Header header;
+    std::vector<uint8_t> data;
+    std::string temp_path;
+    uint32_t offsets[5];
+    bool written;
+#if defined(_WIN32)
+    HANDLE file;
+    DWORD count;
+#else
+    FILE *f;
+    int fd;
+#endif
+
+    memset(&header, 0, sizeof(header));
+    header.magic = WAVE_CACHE_FILE_MAGIC;
+    header.version = WAVE_CACHE_FILE_VERSION;
+    header.rom_checksum = rom_checksum;
+    header.struct_sizes[0] = sizeof(Wave_Cache_Entry);
+    header.struct_sizes[1] = sizeof(Note_Template);
+    header.struct_sizes[2] = sizeof(Flags_Segment);
+    header.struct_sizes[3] = sizeof(Flags2_Segment);
+    header.sample_count = (uint32_t)wave_cache_samples.size();
+    header.entry_count = (uint32_t)wave_cache_index.size();
+    header.note_template_count = (uint32_t)note_templates.size();
+    header.flags_segment_count = (uint32_t)flags_segments.size();
+    header.flags2_segment_count = (uint32_t)flags2_segments.size();
+    header.file_size = wave_cache_file_layout(&header, offsets);
+    if (header.file_size == 0)
+    {
+        return;
+    }
+
+    data.resize(header.file_size, 0);
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(&(data[offsets[0]]), wave_cache_samples.data(), wave_cache_samples.size() * sizeof(int16_t));
+    memcpy(&(data[offsets[1]]), wave_cache_index.data(), wave_cache_index.size() * sizeof(Wave_Cache_Entry));
+    memcpy(&(data[offsets[2]]), note_templates.data(), note_templates.size() * sizeof(Note_Template));
+    memcpy(&(data[offsets[3]]), flags_segments.data(), flags_segments.size() * sizeof(Flags_Segment));
+    memcpy(&(data[offsets[4]]), flags2_segments.data(), flags2_segments.size() * sizeof(Flags2_Segment));
+
+#if defined(_WIN32)
+    temp_path = wave_cache_path + "." + std::to_string(GetCurrentProcessId()) + "." + std::to_string((uintptr_t)this);
+    file = CreateFileA(temp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    written = WriteFile(file, data.data(), (DWORD)data.size(), &count, nullptr) && (count == data.size());
+    written = CloseHandle(file) && written;
+#else
+    temp_path = wave_cache_path + ".XXXXXX";
+    fd = mkstemp(&(temp_path[0]));
+    if (fd < 0)
+    {
+        return;
+    }
+    f = fdopen(fd, "wb");
+    if (f == nullptr)
+    {
+        close(fd);
+        remove(temp_path.c_str());
+        return;
+    }
+    written = (fwrite(data.data(), 1, data.size(), f) == data.size());
+    written = (fclose(f) == 0) && written;
+#endif
+
+#if defined(_WIN32)
+    if (!written || !MoveFileExA(temp_path.c_str(), wave_cache_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if (!written || (rename(temp_path.c_str(), wave_cache_path.c_str()) != 0))
+#endif
+    {
+        remove(temp_path.c_str());
+    }
+}
+
+// Expands the bank 10 envelope row at offset into flags_segments, once per
+// distinct row, and returns the index of its first segment.
+uint32_t VLSG::AddFlagsRow(std::map<uint32_t, uint32_t>& rows, uint32_t offset)
+{
+    uint32_t first;
+    int index;
+
+    auto row = rows.find(offset);
+    if (row != rows.end())
+    {
+        return row->second;
+    }
+
+    first = (uint32_t)flags_segments.size();
+    flags_segments.resize(first + ENVELOPE_ROW_SEGMENTS);
+    for (index = 0; index < ENVELOPE_ROW_SEGMENTS; index++)
+    {
+        if (offset + 4 * index + 4 > ROM_SIZE) break;
+
+        flags_segments[first + index].field_48 = (int16_t)READ_LE_UINT16(&(romsxgm_ptr[offset + 4 * index]));
+        flags_segments[first + index].field_4A = (int16_t)READ_LE_UINT16(&(romsxgm_ptr[offset + 4 * index + 2]));
+    }
+
+    rows.emplace(offset, first);
+    return first;
+}
+
+// Same for a bank 11 row into flags2_segments. The second word of a stage
+// holds its rate as a packed exponent, which is unpacked here.
+uint32_t VLSG::AddFlags2Row(std::map<uint32_t, uint32_t>& rows, uint32_t offset)
+{
+    uint32_t first;
+    int index;
+    int32_t value2;
+    int32_t value3;
+
+    auto row = rows.find(offset);
+    if (row != rows.end())
+    {
+        return row->second;
+    }
+
+    first = (uint32_t)flags2_segments.size();
+    flags2_segments.resize(first + ENVELOPE_ROW_SEGMENTS);
+    for (index = 0; index < ENVELOPE_ROW_SEGMENTS; index++)
+    {
+        if (offset + 4 * index + 4 > ROM_SIZE) break;
+
+        value2 = READ_LE_UINT16(&(romsxgm_ptr[offset + 4 * index + 2])) >> 8;
+        if ((value2 & 0xE0) == 0x20)
+        {
+            value3 = (value2 & 0x1F) << 8;
+        }
+        else
+        {
+            value3 = value2;
+            if ((value2 & 0xE0) != 0)
+            {
+                value2 = (value2 >> 5) + 6;
+                value3 = (value3 & 0x1F) + 32;
+            }
+            else
+            {
+                value2 >>= 2;
+                value3 &= 3;
+            }
+            value3 <<= value2;
+        }
+
+        if (value3 > 0x7FFF)
+        {
+            value3 = 0x7FFF;
+        }
+
+        flags2_segments[first + index].v_vol = READ_LE_UINT16(&(romsxgm_ptr[offset + 4 * index]));
+        flags2_segments[first + index].field_50 = (int16_t)value3;
+    }
+
+    rows.emplace(offset, first);
+    return first;
+}
+
+// Appends the samples decoded from the word at position (even) up to the wave
+// end, then the guard pair the mixer read there: the loop start sample (and
+// the one after it) rebuilt from the header stored at the wave end.
+uint32_t VLSG::DecodeWavePass(uint32_t position, uint32_t end, uint32_t loop_start, int32_t sample, uint32_t shift)
+{
+    uint32_t offset1;
+    uint32_t value1;
+    int32_t value2;
+    uint32_t value3;
+
+    offset1 = (uint32_t)wave_cache_samples.size();
+
+    for (; position < end; position += 2)
+    {
+        value1 = READ_LE_UINT16(&(romsxgm_ptr[position]));
+        shift += dword_C00342C0[value1 & 3];
+        sample += (((int32_t)(value1 << 23)) >> 25) << shift;
+        wave_cache_samples.push_back(clamp_sample(sample));
+        sample += (((int32_t)(value1 << 16)) >> 25) << shift;
+        wave_cache_samples.push_back(clamp_sample(sample));
+    }
+
+    value2 = ((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[end])) << 17)) >> 17;
+    value3 = romsxgm_ptr[end + 10] & 7;
+    if ((loop_start & 1) != 0)
+    {
+        wave_cache_samples.push_back(clamp_sample(value2));
+        wave_cache_samples.push_back(clamp_sample(value2));
+    }
+    else
+    {
+        wave_cache_samples.push_back(clamp_sample(value2 - ((((int32_t)(READ_LE_UINT16(&(romsxgm_ptr[loop_start & ~1])) << 16)) >> 25) << value3)));
+        wave_cache_samples.push_back(clamp_sample(value2));
+    }
+
+    return offset1;
+}
+
+void VLSG::EnableReverb(void)
+{
+    is_reverb_enabled = 1;
+}
+
+void VLSG::DisableReverb(void)
+{
+    is_reverb_enabled = 0;
+    reverb_clear_count++;
+    if (reverb_pipeline_active)
+    {
+        return;  // the worker owns the reverb state and clears it
+    }
+    reverb_worker_clear_count = reverb_clear_count;
+#ifdef _MSC_VER
+    __stosd((unsigned long*)reverb_data_buffer, 0, sizeof(reverb_data_buffer) / 4);
+#else
+    memset(reverb_data_buffer, 0, sizeof(reverb_data_buffer));
+#endif
+    reverb_comb_value[0] = 0;
+    reverb_comb_value[1] = 0;
+}
+
+void VLSG::SetReverbShift(uint32_t shift)
+{
+    reverb_shift = shift;
+}
+
+// The reverb delay lines, as placed in reverb_data_buffer. Each is a ring of a
+// power of two entries indexed by reverb_data_index.
+#define REVERB_ALLPASS1_LINE 0     // 512 entries
+#define REVERB_ALLPASS2_LINE 512   // 512 entries
+#define REVERB_ALLPASS3_LINE 1024  // 256 entries
+#define REVERB_ALLPASS4_LINE 1280  // 256 entries
+#define REVERB_COMB1_LINE 1536     // 2048 entries
+#define REVERB_COMB2_LINE 3584     // 2048 entries
+
+// Copies count entries of a delay line starting at position.
+static inline void reverb_read(const int32_t *line, uint32_t mask, uint32_t position, int32_t *data, uint32_t count)
+{
+    uint32_t run;
+
+    position &= mask;
+    run = (count < mask + 1 - position) ? count : (mask + 1 - position);
+    memcpy(data, line + position, run * sizeof(int32_t));
+    memcpy(data + run, line, (count - run) * sizeof(int32_t));
+}
+
+static inline void reverb_write(int32_t *line, uint32_t mask, uint32_t position, const int32_t *data, uint32_t count)
+{
+    uint32_t run;
+
+    position &= mask;
+    run = (count < mask + 1 - position) ? count : (mask + 1 - position);
+    memcpy(line + position, data, run * sizeof(int32_t));
+    memcpy(line, data + run, (count - run) * sizeof(int32_t));
+}
+
+// One allpass filter over a block. The block is shorter than the delay, so
+// everything it reads was written by earlier blocks.
+static inline void reverb_allpass(int32_t *line, uint32_t mask, uint32_t delay, uint32_t position, int32_t *data, uint32_t count)
+{
+    int32_t tap[REVERB_BLOCK_SIZE];
+    int32_t feed[REVERB_BLOCK_SIZE];
+    uint32_t index;
+
+    reverb_read(line, mask, position - delay, tap, count);
+    for (index = 0; index < count; index++)
+    {
+        feed[index] = data[index] - (tap[index] >> 1);
+        data[index] = (data[index] >> 1) + tap[index];
+    }
+    reverb_write(line, mask, position, feed, count);
+}
+
+// One comb filter over a block; only the one sample feedback of the comb
+// output is serial.
+static inline void reverb_comb(int32_t *line, uint32_t mask, uint32_t delay, int32_t gain, int32_t *value, uint32_t position, const int32_t *data, uint32_t count)
+{
+    int32_t tap[REVERB_BLOCK_SIZE];
+    int32_t feed[REVERB_BLOCK_SIZE];
+    int32_t value1;
+    uint32_t index;
+
+    reverb_read(line, mask, position - delay, tap, count);
+    for (index = 0; index < count; index++)
+    {
+        tap[index] = (gain * tap[index]) >> 8;
+    }
+
+    value1 = *value;
+    for (index = 0; index < count; index++)
+    {
+        value1 = (value1 >> 3) - tap[index];
+        feed[index] = value1 + data[index];
+    }
+    *value = value1;
+
+    reverb_write(line, mask, position, feed, count);
+}
+
+// Adds the reverb of a block of mixed samples to it, count is at most
+// REVERB_BLOCK_SIZE. This is the ROM driver's per-sample reverb with its single
+// 32768 entry ring split into the delay lines its taps amount to: allpass
+// filters of 500, 325, 211 and 137 samples, then two combs of 1998 and 1938
+// samples that are tapped for the output.
+void VLSG::ProcessReverb(int32_t *left, int32_t *right, uint32_t count, uint32_t shift)
+{
+    int32_t data[REVERB_BLOCK_SIZE];
+    int32_t wet_left[REVERB_BLOCK_SIZE];
+    int32_t wet_right[REVERB_BLOCK_SIZE];
+    int32_t tap1[REVERB_BLOCK_SIZE];
+    int32_t tap2[REVERB_BLOCK_SIZE];
+    uint32_t index;
+
+    // The output taps come from before this block is written into the comb
+    // lines, which would otherwise overwrite the oldest of them.
+    reverb_read(reverb_data_ptr + REVERB_COMB1_LINE, 2047, reverb_data_index - 1998, tap1, count);
+    reverb_read(reverb_data_ptr + REVERB_COMB2_LINE, 2047, reverb_data_index - 1783, tap2, count);
+    for (index = 0; index < count; index++)
+    {
+        wet_left[index] = (tap1[index] + tap2[index]) >> shift;
+    }
+
+    reverb_read(reverb_data_ptr + REVERB_COMB1_LINE, 2047, reverb_data_index - 1838, tap1, count);
+    reverb_read(reverb_data_ptr + REVERB_COMB2_LINE, 2047, reverb_data_index - 1938, tap2, count);
+    for (index = 0; index < count; index++)
+    {
+        wet_right[index] = (tap1[index] + tap2[index]) >> shift;
+    }
+
+    for (index = 0; index < count; index++)
+    {
+        data[index] = (left[index] + right[index]) >> 3;
+    }
+
+    reverb_allpass(reverb_data_ptr + REVERB_ALLPASS1_LINE, 511, 500, reverb_data_index, data, count);
+    reverb_allpass(reverb_data_ptr + REVERB_ALLPASS2_LINE, 511, 325, reverb_data_index, data, count);
+    reverb_allpass(reverb_data_ptr + REVERB_ALLPASS3_LINE, 255, 211, reverb_data_index, data, count);
+    reverb_allpass(reverb_data_ptr + REVERB_ALLPASS4_LINE, 255, 137, reverb_data_index, data, count);
+
+    for (index = 0; index < count; index++)
+    {
+        data[index] >>= 1;
+    }
+
+    reverb_comb(reverb_data_ptr + REVERB_COMB1_LINE, 2047, 1998, 96, &(reverb_comb_value[0]), reverb_data_index, data, count);
+    reverb_comb(reverb_data_ptr + REVERB_COMB2_LINE, 2047, 1938, 97, &(reverb_comb_value[1]), reverb_data_index, data, count);
+
+    for (index = 0; index < count; index++)
+    {
+        left[index] += wet_left[index];
+        right[index] += wet_right[index];
+    }
+
+    reverb_data_index += count;
+}
+
+#if defined(_WIN32)
+VLSG_Semaphore::VLSG_Semaphore() { handle = CreateSemaphoreA(nullptr, 0, LONG_MAX, nullptr); }
+VLSG_Semaphore::~VLSG_Semaphore() { CloseHandle(handle); }
+void VLSG_Semaphore::Post(void) { ReleaseSemaphore(handle, 1, nullptr); }
+void VLSG_Semaphore::Wait(void) { WaitForSingleObject(handle, INFINITE); }
+#elif defined(__APPLE__)
+VLSG_Semaphore::VLSG_Semaphore() { handle = dispatch_semaphore_create(0); }
+VLSG_Semaphore::~VLSG_Semaphore() { dispatch_release(handle); }
+void VLSG_Semaphore::Post(void) { dispatch_semaphore_signal(handle); }
+void VLSG_Semaphore::Wait(void) { dispatch_semaphore_wait(handle, DISPATCH_TIME_FOREVER); }
+#else
+VLSG_Semaphore::VLSG_Semaphore() { sem_init(&handle, 0, 0); }
+VLSG_Semaphore::~VLSG_Semaphore() { sem_destroy(&handle); }
+void VLSG_Semaphore::Post(void) { sem_post(&handle); }
+void VLSG_Semaphore::Wait(void) { while (sem_wait(&handle) != 0 && errno == EINTR) {} }
+#endif
+
+// With the reverb pipeline on, VLSG_BufferVst mixes into REVERB_BLOCK_SIZE
+// frame slots that the worker thread runs ProcessReverb on. The output is
+// taken two slots behind the mix, so the worker has a whole slot's worth of
+// voice rendering to finish the previous one. The slot counters are only ever
+// advanced, the audio thread publishing and the worker completing them.
+void VLSG::RunReverbPipeline(int32_t *left, int32_t *right, uint32_t count)
+{
+    Reverb_Pipeline_Slot *slot;
+    Reverb_Pipeline_Slot *delayed_slot;
+    uint32_t index;
+
+    slot = &(reverb_pipeline_slots[reverb_pipeline_slot & (REVERB_PIPELINE_SLOTS - 1)]);
+    delayed_slot = &(reverb_pipeline_slots[(reverb_pipeline_slot - 2) & (REVERB_PIPELINE_SLOTS - 1)]);
+
+    if (reverb_pipeline_position == 0)
+    {
+        while ((int32_t)(reverb_pipeline_done.load(std::memory_order_acquire) - (reverb_pipeline_slot - 1)) < 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    for (index = 0; index < count; index++)
+    {
+        slot->left[reverb_pipeline_position + index] = left[index];
+        slot->right[reverb_pipeline_position + index] = right[index];
+        left[index] = delayed_slot->left[reverb_pipeline_position + index];
+        right[index] = delayed_slot->right[reverb_pipeline_position + index];
+    }
+
+    reverb_pipeline_position += count;
+    if (reverb_pipeline_position == REVERB_BLOCK_SIZE)
+    {
+        slot->is_reverb_enabled = is_reverb_enabled;
+        slot->reverb_shift = reverb_shift;
+        slot->reverb_clear_count = reverb_clear_count;
+
+        reverb_pipeline_slot++;
+        reverb_pipeline_position = 0;
+        reverb_pipeline_published.store(reverb_pipeline_slot);
+        if (reverb_worker_sleeping.exchange(false))
+        {
+            reverb_worker_wake.Post();
+        }
+    }
+}
+
+// Turns the reverb pipeline on or off once the worker has caught up, so the
+// reverb state has a single owner at a time. Turning it off drops the two
+// slots still to be output, REVERB_PIPELINE_LATENCY mixed frames, without a
+// fade; the output jumps ahead by that much.
+void VLSG::SwitchReverbPipeline(void)
+{
+    while (reverb_pipeline_done.load(std::memory_order_acquire) != reverb_pipeline_published.load(std::memory_order_relaxed))
+    {
+        std::this_thread::yield();
+    }
+
+    if (!reverb_pipeline_active)
+    {
+        memset(reverb_pipeline_slots, 0, sizeof(reverb_pipeline_slots));
+        reverb_pipeline_slot = reverb_pipeline_published.load(std::memory_order_relaxed);
+        reverb_pipeline_position = 0;
+    }
+    else if (reverb_worker_clear_count != reverb_clear_count)
+    {
+        memset(reverb_data_buffer, 0, sizeof(reverb_data_buffer));
+        reverb_comb_value[0] = 0;
+        reverb_comb_value[1] = 0;
+        reverb_worker_clear_count = reverb_clear_count;
+    }
+
+    reverb_pipeline_active = !reverb_pipeline_active;
+}
+
+void VLSG::ReverbWorker(void)
+{
+    Reverb_Pipeline_Slot *slot;
+    uint32_t next_slot;
+
+    next_slot = reverb_pipeline_done.load(std::memory_order_relaxed);
+    while (!reverb_worker_exit.load())
+    {
+        if (reverb_pipeline_published.load(std::memory_order_acquire) == next_slot)
+        {
+            // Either the slot is seen published after the flag is set, or
+            // RunReverbPipeline sees the flag and posts. With the pipeline off
+            // the worker stays parked here.
+            reverb_worker_sleeping.store(true);
+            if (reverb_pipeline_published.load() == next_slot && !reverb_worker_exit.load())
+            {
+                reverb_worker_wake.Wait();
+            }
+            else if (!reverb_worker_sleeping.exchange(false))
+            {
+                reverb_worker_wake.Wait();  // take the post already on its way
+            }
+            continue;
+        }
+
+        slot = &(reverb_pipeline_slots[next_slot & (REVERB_PIPELINE_SLOTS - 1)]);
+        if (slot->reverb_clear_count != reverb_worker_clear_count)
+        {
+            memset(reverb_data_buffer, 0, sizeof(reverb_data_buffer));
+            reverb_comb_value[0] = 0;
+            reverb_comb_value[1] = 0;
+            reverb_worker_clear_count = slot->reverb_clear_count;
+        }
+        if (slot->is_reverb_enabled == 1)
+        {
+            ProcessReverb(slot->left, slot->right, REVERB_BLOCK_SIZE, slot->reverb_shift);
+        }
+
+        next_slot++;
+        reverb_pipeline_done.store(next_slot, std::memory_order_release);
+    }
+}
+
+inline int VLSG::GetVoiceIndex(const Voice_Data *voice_data_ptr) const
+{
+    return (int)(voice_data_ptr - voice_data);
+}
+
+void VLSG::CopyVoice(int dst_index, int src_index)
+{
+    voice_data[dst_index] = voice_data[src_index];
+
+    voice_mix.wv_fpos[dst_index] = voice_mix.wv_fpos[src_index];
+    voice_mix.wv_end[dst_index] = voice_mix.wv_end[src_index];
+    voice_mix.wv_start[dst_index] = voice_mix.wv_start[src_index];
+    voice_mix.wv_base[dst_index] = voice_mix.wv_base[src_index];
+    voice_mix.v_freq[dst_index] = voice_mix.v_freq[src_index];
+    voice_mix.field_2C[dst_index] = voice_mix.field_2C[src_index];
+    voice_mix.field_30[dst_index] = voice_mix.field_30[src_index];
+    voice_mix.field_34[dst_index] = voice_mix.field_34[src_index];
+    voice_mix.field_38[dst_index] = voice_mix.field_38[src_index];
+    voice_mix.v_stack[dst_index] = voice_mix.v_stack[src_index];
+}
+
+// Mix kernels: interpolate each voice's current sample pair from the wave cache,
+// smooth its gain towards the envelope target, apply it and accumulate the panned
+// result, once for each note stacked on the voice (the same sum as that many
+// voices). All variants do the same wrapping int32 arithmetic, so their output
+// matches MixVoicesScalar bit for bit regardless of how many voices go per
+// instruction. They mix the lanes from index up to count and return nonzero
+// when one of those voices has moved past its wave end.
+typedef int (*Mix_Kernel)(Voice_Mix_Data* mix, const int16_t* samples, int index, int count, int32_t* left, int32_t* right);
+
+static int MixVoiceRange(Voice_Mix_Data* mix, const int16_t* samples, int index, int count, int32_t* left, int32_t* right)
+{
+    const int16_t* sample_ptr;
+    int32_t value6;
+    int32_t value7;
+    int wrapped;
+
+    wrapped = 0;
+    for (; index < count; index++)
+    {
+        sample_ptr = &(samples[mix->wv_base[index] + (mix->wv_fpos[index] >> 10)]);
+        value7 = sample_ptr[0];
+        value7 += ((int32_t)((sample_ptr[1] - value7) * (mix->wv_fpos[index] & 0x3FF))) >> 10;
+        value6 = ((int32_t)(15 * mix->field_2C[index] + mix->field_38[index])) >> 4;
+        value7 = ((int32_t)(value7 * value6)) >> 12;
+
+        mix->field_2C[index] = value6;
+        mix->wv_fpos[index] += mix->v_freq[index];
+        wrapped |= ((mix->wv_fpos[index] >> 10) >= mix->wv_end[index]);
+        *left += (int32_t)((value7 >> mix->field_30[index]) * mix->v_stack[index]);
+        *right += (int32_t)((value7 >> mix->field_34[index]) * mix->v_stack[index]);
+    }
+    return wrapped;
+}
+
+static int MixVoicesScalar(Voice_Mix_Data* mix, const int16_t* samples, int index, int count, int32_t* left, int32_t* right)
+{
+    return MixVoiceRange(mix, samples, index, count, left, right);
+}
+
+#if VLSG_SIMD_X86
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VLSG_TARGET(x) __attribute__((target(x)))
+#else
+#define VLSG_TARGET(x)
+#endif
+
+static inline int32_t mix_load_pair(const int16_t* samples, const Voice_Mix_Data* mix, int index)
+{
+    int32_t pair;
+
+    memcpy(&pair, &(samples[mix->wv_base[index] + (mix->wv_fpos[index] >> 10)]), sizeof(pair));
+    return pair;
+}
+
+VLSG_TARGET("sse2")
+static inline __m128i mix_select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// SSE2 has no 32-bit mullo; the low halves of two 32x32->64 products give the same bits.
+VLSG_TARGET("sse2")
+static inline __m128i mix_mullo_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Per-lane arithmetic shift, built from the five power-of-two shifts.
+VLSG_TARGET("sse2")
+static inline __m128i mix_srav_sse2(__m128i value, __m128i count)
+{
+    for (int bit = 1; bit < 32; bit <<= 1)
+    {
+        __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(count, _mm_set1_epi32(bit)), _mm_set1_epi32(bit));
+        value = mix_select_sse2(mask, _mm_sra_epi32(value, _mm_cvtsi32_si128(bit)), value);
+    }
+    return value;
+}
+
+// Sample pairs are fetched as one 32-bit load per voice (the low half is the
+// earlier sample); ROM addresses fit in 22 bits, so signed compares are safe.
+VLSG_TARGET("sse2")
+static int MixVoicesSSE2(Voice_Mix_Data* mix, const int16_t* samples, int index, int count, int32_t* left, int32_t* right)
+{
+    __m128i sum_left = _mm_setzero_si128();
+    __m128i sum_right = _mm_setzero_si128();
+    __m128i in_range = _mm_set1_epi32(-1);
+
+    for (; index + 4 <= count; index += 4)
+    {
+        __m128i fpos = _mm_loadu_si128((const __m128i*)&mix->wv_fpos[index]);
+        __m128i pairs = _mm_setr_epi32(mix_load_pair(samples, mix, index), mix_load_pair(samples, mix, index + 1),
+                                       mix_load_pair(samples, mix, index + 2), mix_load_pair(samples, mix, index + 3));
+        __m128i s0 = _mm_srai_epi32(_mm_slli_epi32(pairs, 16), 16);
+        __m128i s1 = _mm_srai_epi32(pairs, 16);
+        __m128i frac = _mm_and_si128(fpos, _mm_set1_epi32(0x3FF));
+        __m128i value7 = _mm_add_epi32(s0, _mm_srai_epi32(mix_mullo_sse2(_mm_sub_epi32(s1, s0), frac), 10));
+        __m128i value6 = _mm_loadu_si128((const __m128i*)&mix->field_2C[index]);
+
+        value6 = _mm_sub_epi32(_mm_slli_epi32(value6, 4), value6);
+        value6 = _mm_srai_epi32(_mm_add_epi32(value6, _mm_loadu_si128((const __m128i*)&mix->field_38[index])), 4);
+        value7 = _mm_srai_epi32(mix_mullo_sse2(value7, value6), 12);
+        __m128i stack = _mm_loadu_si128((const __m128i*)&mix->v_stack[index]);
+
+        fpos = _mm_add_epi32(fpos, _mm_loadu_si128((const __m128i*)&mix->v_freq[index]));
+        in_range = _mm_and_si128(in_range, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)&mix->wv_end[index]), _mm_srli_epi32(fpos, 10)));
+        _mm_storeu_si128((__m128i*)&mix->field_2C[index], value6);
+        _mm_storeu_si128((__m128i*)&mix->wv_fpos[index], fpos);
+        sum_left = _mm_add_epi32(sum_left, mix_mullo_sse2(mix_srav_sse2(value7, _mm_loadu_si128((const __m128i*)&mix->field_30[index])), stack));
+        sum_right = _mm_add_epi32(sum_right, mix_mullo_sse2(mix_srav_sse2(value7, _mm_loadu_si128((const __m128i*)&mix->field_34[index])), stack));
+    }
+
+    sum_left = _mm_add_epi32(sum_left, _mm_shuffle_epi32(sum_left, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum_left = _mm_add_epi32(sum_left, _mm_shuffle_epi32(sum_left, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum_right = _mm_add_epi32(sum_right, _mm_shuffle_epi32(sum_right, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum_right = _mm_add_epi32(sum_right, _mm_shuffle_epi32(sum_right, _MM_SHUFFLE(2, 3, 0, 1)));
+    *left += _mm_cvtsi128_si32(sum_left);
+    *right += _mm_cvtsi128_si32(sum_right);
+
+    return (_mm_movemask_epi8(in_range) != 0xFFFF) | MixVoiceRange(mix, samples, index, count, left, right);
+}
+
+VLSG_TARGET("avx2")
+static int MixVoicesAVX2(Voice_Mix_Data* mix, const int16_t* samples, int index, int count, int32_t* left, int32_t* right)
+{
+    __m256i sum_left = _mm256_setzero_si256();
+    __m256i sum_right = _mm256_setzero_si256();
+    __m256i in_range = _mm256_set1_epi32(-1);
+    __m128i sum;
+
+    for (; index + 8 <= count; index += 8)
+    {
+        __m256i fpos = _mm256_loadu_si256((const __m256i*)&mix->wv_fpos[index]);
+        __m256i offset = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&mix->wv_base[index]), _mm256_srli_epi32(fpos, 10));
+        __m256i pairs = _mm256_i32gather_epi32((const int*)samples, offset, 2);
+        __m256i s0 = _mm256_srai_epi32(_mm256_slli_epi32(pairs, 16), 16);
+        __m256i s1 = _mm256_srai_epi32(pairs, 16);
+        __m256i frac = _mm256_and_si256(fpos, _mm256_set1_epi32(0x3FF));
+        __m256i value7 = _mm256_add_epi32(s0, _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(s1, s0), frac), 10));
+        __m256i value6 = _mm256_loadu_si256((const __m256i*)&mix->field_2C[index]);
+
+        value6 = _mm256_sub_epi32(_mm256_slli_epi32(value6, 4), value6);
+        value6 = _mm256_srai_epi32(_mm256_add_epi32(value6, _mm256_loadu_si256((const __m256i*)&mix->field_38[index])), 4);
+        value7 = _mm256_srai_epi32(_mm256_mullo_epi32(value7, value6), 12);
+        __m256i stack = _mm256_loadu_si256((const __m256i*)&mix->v_stack[index]);
+
+        fpos = _mm256_add_epi32(fpos, _mm256_loadu_si256((const __m256i*)&mix->v_freq[index]));
+        in_range = _mm256_and_si256(in_range, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)&mix->wv_end[index]), _mm256_srli_epi32(fpos, 10)));
+        _mm256_storeu_si256((__m256i*)&mix->field_2C[index], value6);
+        _mm256_storeu_si256((__m256i*)&mix->wv_fpos[index], fpos);
+        sum_left = _mm256_add_epi32(sum_left, _mm256_mullo_epi32(_mm256_srav_epi32(value7, _mm256_loadu_si256((const __m256i*)&mix->field_30[index])), stack));
+        sum_right = _mm256_add_epi32(sum_right, _mm256_mullo_epi32(_mm256_srav_epi32(value7, _mm256_loadu_si256((const __m256i*)&mix->field_34[index])), stack));
+    }
+
+    sum = _mm_add_epi32(_mm256_castsi256_si128(sum_left), _mm256_extracti128_si256(sum_left, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    *left += _mm_cvtsi128_si32(sum);
+    sum = _mm_add_epi32(_mm256_castsi256_si128(sum_right), _mm256_extracti128_si256(sum_right, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    *right += _mm_cvtsi128_si32(sum);
+
+    return (_mm256_movemask_epi8(in_range) != -1) | MixVoiceRange(mix, samples, index, count, left, right);
+}
+
+// GCC 12 warns about the _mm512_undefined_epi32() temporaries (__Y) inside
+// its own avx512fintrin.h once these intrinsics are inlined, GCC bug 105593.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+VLSG_TARGET("avx512f")
+static int MixVoicesAVX512(Voice_Mix_Data* mix, const int16_t* samples, int index, int count, int32_t* left, int32_t* right)
+{
+    __m512i sum_left = _mm512_setzero_si512();
+    __m512i sum_right = _mm512_setzero_si512();
+    __mmask16 in_range = 0xFFFF;
+
+    for (; index + 16 <= count; index += 16)
+    {
+        __m512i fpos = _mm512_loadu_si512(&mix->wv_fpos[index]);
+        __m512i offset = _mm512_add_epi32(_mm512_loadu_si512(&mix->wv_base[index]), _mm512_srli_epi32(fpos, 10));
+        __m512i pairs = _mm512_i32gather_epi32(offset, samples, 2);
+        __m512i s0 = _mm512_srai_epi32(_mm512_slli_epi32(pairs, 16), 16);
+        __m512i s1 = _mm512_srai_epi32(pairs, 16);
+        __m512i frac = _mm512_and_si512(fpos, _mm512_set1_epi32(0x3FF));
+        __m512i value7 = _mm512_add_epi32(s0, _mm512_srai_epi32(_mm512_mullo_epi32(_mm512_sub_epi32(s1, s0), frac), 10));
+        __m512i value6 = _mm512_loadu_si512(&mix->field_2C[index]);
+
+        value6 = _mm512_sub_epi32(_mm512_slli_epi32(value6, 4), value6);
+        value6 = _mm512_srai_epi32(_mm512_add_epi32(value6, _mm512_loadu_si512(&mix->field_38[index])), 4);
+        value7 = _mm512_srai_epi32(_mm512_mullo_epi32(value7, value6), 12);
+        __m512i stack = _mm512_loadu_si512(&mix->v_stack[index]);
+
+        fpos = _mm512_add_epi32(fpos, _mm512_loadu_si512(&mix->v_freq[index]));
+        in_range &= _mm512_cmplt_epu32_mask(_mm512_srli_epi32(fpos, 10), _mm512_loadu_si512(&mix->wv_end[index]));
+        _mm512_storeu_si512(&mix->field_2C[index], value6);
+        _mm512_storeu_si512(&mix->wv_fpos[index], fpos);
+        sum_left = _mm512_add_epi32(sum_left, _mm512_mullo_epi32(_mm512_srav_epi32(value7, _mm512_loadu_si512(&mix->field_30[index])), stack));
+        sum_right = _mm512_add_epi32(sum_right, _mm512_mullo_epi32(_mm512_srav_epi32(value7, _mm512_loadu_si512(&mix->field_34[index])), stack));
+    }
+
+    *left += _mm512_reduce_add_epi32(sum_left);
+    *right += _mm512_reduce_add_epi32(sum_right);
+
+    return (in_range != 0xFFFF) | MixVoiceRange(mix, samples, index, count, left, right);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+static Mix_Kernel SelectMixKernel(void)
+{
+#if VLSG_SIMD_X86 && !defined(VLSG_NO_SIMD)
+    bool has_sse2, has_avx2, has_avx512;
+
+#ifdef _MSC_VER
+    int info[4];
+    int max_leaf;
+    uint64_t xcr0 = 0;
+
+    __cpuid(info, 0);
+    max_leaf = info[0];
+    __cpuid(info, 1);
+    has_sse2 = ((info[3] >> 26) & 1) != 0;
+    has_avx2 = false;
+    has_avx512 = false;
+    if ((info[2] & (1 << 27)) != 0) // OSXSAVE
+    {
+        xcr0 = _xgetbv(0);
+    }
+    if (max_leaf >= 7)
+    {
+        __cpuidex(info, 7, 0);
+        has_avx2 = ((xcr0 & 0x06) == 0x06) && ((info[1] >> 5) & 1) != 0;
+        has_avx512 = ((xcr0 & 0xE6) == 0xE6) && ((info[1] >> 16) & 1) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    has_sse2 = __builtin_cpu_supports("sse2");
+    has_avx2 = __builtin_cpu_supports("avx2");
+    has_avx512 = __builtin_cpu_supports("avx512f");
+#endif
+
+    if (has_avx512)
+        return MixVoicesAVX512;
+    if (has_avx2)
+        return MixVoicesAVX2;
+    if (has_sse2)
+        return MixVoicesSSE2;
+#endif
+    return MixVoicesScalar;
+}
+
+static const Mix_Kernel mix_kernel = SelectMixKernel();
+
+inline void VLSG::GenerateOutputDataVst(double **output_ptr, uint32_t offset1, uint32_t offset2)
+{
+  int range_start[MAX_VOICES / 64];
+  int range_end[MAX_VOICES / 64];
+  int range_count;
+  unsigned int index2;
+  unsigned int index3;
+  unsigned int count;
+  int32_t left[REVERB_BLOCK_SIZE];
+  int32_t right[REVERB_BLOCK_SIZE];
+
+  // Voices only start on phase boundaries, so the lanes to mix are found once
+  // per span; voices that end within it are parked and mix silence.
+  range_count = GetActiveVoiceRanges(range_start, range_end);
+
+  for (index2 = offset1; index2 < offset2; index2 += count)
+  {
+    count = offset2 - index2;
+    if (count > REVERB_BLOCK_SIZE)
+      count = REVERB_BLOCK_SIZE;
+    if (reverb_pipeline_active && (count > REVERB_BLOCK_SIZE - reverb_pipeline_position))
+      count = REVERB_BLOCK_SIZE - reverb_pipeline_position;
+
+    MixVoiceBlock(left, right, count, range_start, range_end, range_count);
+
+    if (reverb_pipeline_active)
+    {
+      RunReverbPipeline(left, right, count);
+    }
+    else if (is_reverb_enabled == 1)
+    {
+      ProcessReverb(left, right, count, reverb_shift);
+    }
+
+    for (index3 = 0; index3 < count; index3++)
+    {
+      // Floating point supports going beyond clipping so F IT.
+      //if (left > 32767)
+      //{
+      //  left = 32767;
+      //}
+      //else if (left <= -32767)
+      //{
+      //  left = -32767;
+      //}
+
+      //if (right > 32767)
+      //{
+      //  right = 32767;
+      //}
+      //else if (right <= -32767)
+      //{
+      //  right = -32767;
+      //}
+
+      (output_ptr)[0][index2 + index3] = left[index3] / 32768.0;
+      (output_ptr)[1][index2 + index3] = right[index3] / 32768.0;
+    }
+  }
+}
+
+void VLSG::GenerateOutputData(uint8_t *output_ptr, uint32_t offset1, uint32_t offset2)
+{
+    int range_start[MAX_VOICES / 64];
+    int range_end[MAX_VOICES / 64];
+    int range_count;
+    unsigned int index2;
+    unsigned int index3;
+    unsigned int count;
+    int32_t left[REVERB_BLOCK_SIZE];
+    int32_t right[REVERB_BLOCK_SIZE];
+
+    range_count = GetActiveVoiceRanges(range_start, range_end);
+
+    for (index2 = offset1; index2 < offset2; index2 += count)
+    {
+        count = offset2 - index2;
+        if (count > REVERB_BLOCK_SIZE)
+            count = REVERB_BLOCK_SIZE;
+
+        MixVoiceBlock(left, right, count, range_start, range_end, range_count);
+
+        if (is_reverb_enabled == 1)
+        {
+            ProcessReverb(left, right, count, reverb_shift);
+        }
+
+        for (index3 = 0; index3 < count; index3++)
+        {
+            if (left[index3] > 32767)
+            {
+                left[index3] = 32767;
+            }
+            else if (left[index3] <= -32767)
+            {
+                left[index3] = -32767;
+            }
+
+            if (right[index3] > 32767)
+            {
+                right[index3] = 32767;
+            }
+            else if (right[index3] <= -32767)
+            {
+                right[index3] = -32767;
+            }
+
+            ((int16_t *)output_ptr)[2 * (index2 + index3)] = left[index3];
+            ((int16_t *)output_ptr)[2 * (index2 + index3) + 1] = right[index3];
+        }
+    }
+}
+
+// Brings each voice's decoded sample history up to its current wave position,
+// handling the loop and end points. Interpolation and mixing is left to
+// mix_kernel.
+// Runs before a sample is mixed whenever the previous one moved a voice past its
+// wave end, which is where the ROM decoder checked for it.
+inline void VLSG::WrapVoiceSamples(int first_index, int last_index, Voice_Thread_Data *thread_data)
+{
+    int index1;
+
+    for (index1 = first_index; index1 < last_index; index1++)
+    {
+        if ((voice_mix.wv_fpos[index1] >> 10) >= voice_mix.wv_end[index1])
+        {
+            WrapVoiceSample(index1, thread_data);
+        }
+    }
+}
+
+// Moves a voice that has read past its wave end back into the loop, with the
+// same position arithmetic as the ROM decoder, or parks it if the wave does not
+// loop and leaves freeing it to MixVoiceBlock. Loops shorter than the overshoot
+// are wrapped until the voice is back inside, so it never reads past the cached
+// samples.
+void VLSG::WrapVoiceSample(int index, Voice_Thread_Data *thread_data)
+{
+    uint32_t value1;
+    uint32_t value2;
+    uint32_t value3;
+
+    value1 = voice_mix.wv_end[index];
+    while ((value2 = voice_mix.wv_fpos[index] >> 10) >= value1)
+    {
+        if (value1 == voice_mix.wv_start[index])
+        {
+            ParkVoice(index);
+            voice_data[index].field_28 = 0;
+            thread_data->ended[thread_data->ended_count] = index;
+            thread_data->ended_count++;
+            return;
+        }
+
+        value3 = (value2 + (voice_mix.wv_start[index] & 1) - value1) & ~1;
+        if (value3 >= 10)
+        {
+            voice_mix.wv_fpos[index] += (8 - value3) << 10;
+        }
+
+        voice_mix.wv_fpos[index] += (voice_mix.wv_start[index] - voice_mix.wv_end[index]) << 10;
+        voice_mix.wv_base[index] = voice_data[index].wv_loop_base;
+    }
+}
+
+// Mixes count frames of the active voices. With voice threads, the lanes are
+// split into contiguous shares of about equal size; each thread mixes its own
+// share into its Voice_Thread_Data and the audio thread sums them after. Voices
+// only touch their own lanes and the sums are plain int32 additions, so the
+// result is the same as mixing them all in one place. Voices that end are only
+// parked meanwhile and freed here once every share is done.
+void VLSG::MixVoiceBlock(int32_t *left, int32_t *right, uint32_t count, const int *range_start, const int *range_end, int range_count)
+{
+    Voice_Thread_Data *thread_data;
+    int lanes, share_lanes, filled;
+    int shares, share, index1, start, take;
+    uint32_t index2;
+
+    lanes = 0;
+    for (index1 = 0; index1 < range_count; index1++)
+    {
+        lanes += range_end[index1] - range_start[index1];
+    }
+
+    shares = voice_thread_count + 1;
+    if (shares > lanes / VOICE_THREAD_MIN_LANES)
+    {
+        shares = lanes / VOICE_THREAD_MIN_LANES;
+    }
+    if (shares < 1)
+    {
+        shares = 1;
+    }
+    share_lanes = (lanes + shares - 1) / shares;
+
+    share = 0;
+    filled = 0;
+    voice_thread_data[0].range_count = 0;
+    for (index1 = 0; index1 < range_count; index1++)
+    {
+        for (start = range_start[index1]; start < range_end[index1]; start += take)
+        {
+            if (filled == share_lanes)
+            {
+                share++;
+                filled = 0;
+                voice_thread_data[share].range_count = 0;
+            }
+
+            take = range_end[index1] - start;
+            if (take > share_lanes - filled)
+            {
+                take = share_lanes - filled;
+            }
+
+            thread_data = &(voice_thread_data[share]);
+            thread_data->range_start[thread_data->range_count] = start;
+            thread_data->range_end[thread_data->range_count] = start + take;
+            thread_data->range_count++;
+            filled += take;
         }
-        else if (left <= -32767)
+    }
+    shares = share + 1;
+
+    for (share = 0; share < shares; share++)
+    {
+        voice_thread_data[share].wrap_pending = voice_wrap_pending;
+        voice_thread_data[share].ended_count = 0;
+    }
+
+    if (shares > 1)
+    {
+        voice_job_frames = count;
+        voice_job_done.store(0, std::memory_order_relaxed);
+        voice_job_serial.store(((voice_job_serial.load(std::memory_order_relaxed) >> 4) + 1) << 4 | (shares - 1));
+        for (share = 1; share < shares; share++)
         {
-            left = -32767;
+            if (voice_thread_sleeping[share - 1].exchange(false))
+            {
+                voice_thread_wake[share - 1].Post();
+            }
         }
+    }
+
+    MixVoiceShare(&(voice_thread_data[0]), count);
 
-        if (right > 32767)
+    if (shares > 1)
+    {
+        while (voice_job_done.load(std::memory_order_acquire) < shares - 1)
         {
-            right = 32767;
+            std::this_thread::yield();
         }
-        else if (right <= -32767)
+    }
+
+    for (index2 = 0; index2 < count; index2++)
+    {
+        left[index2] = voice_thread_data[0].left[index2];
+        right[index2] = voice_thread_data[0].right[index2];
+        for (share = 1; share < shares; share++)
         {
-            right = -32767;
+            left[index2] += voice_thread_data[share].left[index2];
+            right[index2] += voice_thread_data[share].right[index2];
         }
+    }
 
-        ((int16_t *)output_ptr)[2 * index2] = left;
-        ((int16_t *)output_ptr)[2 * index2 + 1] = right;
+    voice_wrap_pending = false;
+    for (share = 0; share < shares; share++)
+    {
+        thread_data = &(voice_thread_data[share]);
+        if (thread_data->wrap_pending)
+        {
+            voice_wrap_pending = true;
+        }
+        for (index1 = 0; index1 < thread_data->ended_count; index1++)
+        {
+            SetVoiceFree(thread_data->ended[index1]);
+        }
     }
 }
 
-bool VLSG::InitializeMidiDataBuffer(void)
+void VLSG::MixVoiceShare(Voice_Thread_Data *thread_data, uint32_t count)
 {
-    midi_data_write_index = 0;
-    midi_data_read_index = 0;
-    return true;
+    const int16_t *samples = wave_cache.samples;
+    uint32_t index2;
+    int index1;
+
+    for (index2 = 0; index2 < count; index2++)
+    {
+        thread_data->left[index2] = 0;
+        thread_data->right[index2] = 0;
+        if (thread_data->wrap_pending)
+        {
+            for (index1 = 0; index1 < thread_data->range_count; index1++)
+                WrapVoiceSamples(thread_data->range_start[index1], thread_data->range_end[index1], thread_data);
+        }
+        thread_data->wrap_pending = false;
+        for (index1 = 0; index1 < thread_data->range_count; index1++)
+        {
+            if (mix_kernel(&voice_mix, samples, thread_data->range_start[index1], thread_data->range_end[index1], &(thread_data->left[index2]), &(thread_data->right[index2])))
+                thread_data->wrap_pending = true;
+        }
+    }
 }
 
-bool VLSG::EMPTY_DeinitializeMidiDataBuffer(void)
+// Voice threads spin between buffers, since a handoff per block has to be
+// quick, and only sleep once the audio thread has not given them a share for
+// VOICE_THREAD_SPIN_TIME, a few buffers at usual sizes.
+#define VOICE_THREAD_SPIN_TIME std::chrono::milliseconds(2)
+
+// serial is the last job the worker is not part of.
+void VLSG::VoiceWorker(int thread_index, uint32_t serial)
 {
-    return true;
+    std::chrono::steady_clock::time_point idle_since;
+
+    idle_since = std::chrono::steady_clock::now();
+    while (!voice_threads_exit.load(std::memory_order_relaxed))
+    {
+        if (voice_job_serial.load(std::memory_order_acquire) == serial)
+        {
+            if (std::chrono::steady_clock::now() - idle_since < VOICE_THREAD_SPIN_TIME)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // Either the job is seen after the flag is set, or MixVoiceBlock
+            // sees the flag and posts, as in ReverbWorker. Workers above the
+            // current count stay parked here.
+            voice_thread_sleeping[thread_index - 1].store(true);
+            if (voice_job_serial.load() == serial && !voice_threads_exit.load())
+            {
+                voice_thread_wake[thread_index - 1].Wait();
+            }
+            else if (!voice_thread_sleeping[thread_index - 1].exchange(false))
+            {
+                voice_thread_wake[thread_index - 1].Wait();  // take the post already on its way
+            }
+            idle_since = std::chrono::steady_clock::now();
+            continue;
+        }
+
+        // The audio thread waits for every share before the next job, so no
+        // job this thread is part of can be skipped here.
+        serial = voice_job_serial.load(std::memory_order_acquire);
+        if (thread_index <= (int)(serial & 0xF))
+        {
+            MixVoiceShare(&(voice_thread_data[thread_index]), voice_job_frames);
+            voice_job_done.fetch_add(1, std::memory_order_release);
+            idle_since = std::chrono::steady_clock::now();
+        }
+    }
 }
 
-void VLSG::AddByteToMidiDataBuffer(uint8_t value)
+bool VLSG::InitializeMidiDataBuffer(void)
 {
-    uint32_t write_index;
+    midi_event_write_index.store(0);
+    midi_event_read_index.store(0);
+    midi_write_event.length = 0;
+    midi_write_record_length = 0;
+    midi_write_status = 0;
+    midi_write_needed = 0;
+    midi_batch_count = 0;
+    midi_batch_index = 0;
+    midi_batch_coalesced = 0;
+    memset(midi_batch_note_on, 0xFF, sizeof(midi_batch_note_on));
+    midi_batch_received.store(0);
+    midi_batch_merged.store(0);
+    midi_batch_cancelled.store(0);
+    midi_batch_duplicates.store(0);
+    midi_batch_overflowed.store(0);
+
+    // Kept until the size changes; new[] leaves the pages untouched until used.
+    if ((midi_batch == nullptr) || (midi_batch_capacity != midi_batch_size_requested))
+    {
+        delete[] midi_batch;
+        midi_batch = new (std::nothrow) Midi_Batch_Event[2 * midi_batch_size_requested];
+        if (midi_batch == nullptr)
+        {
+            midi_batch_sorted = nullptr;
+            midi_batch_capacity = 0;
+            return false;
+        }
+        midi_batch_sorted = midi_batch + midi_batch_size_requested;
+        midi_batch_capacity = midi_batch_size_requested;
+    }
+    return true;
+}
 
-    write_index = midi_data_write_index;
-    midi_data_buffer[write_index] = value;
-    midi_data_write_index = (write_index + 1) & 0xFFFF;
+bool VLSG::EMPTY_DeinitializeMidiDataBuffer(void)
+{
+    return true;
 }
 
-uint8_t VLSG::GetValueFromMidiDataBuffer(void)
+// Frames the bytes of VLSG_Write into events, one per message and at most
+// MIDI_EVENT_DATA bytes of SysEx each, in the order ProcessMidiByte takes them.
+// Realtime messages are dropped here instead of by the parser.
+void VLSG::AddByteToMidiEvent(uint8_t value)
 {
-    uint32_t write_index, read_index;
-    int index;
-    uint32_t event_time;
-    uint32_t time_2;
-    uint8_t result;
+    if (value > 0xF7) return;
 
-    write_index = midi_data_write_index;
-    read_index = midi_data_read_index;
-    if (write_index == read_index)
+    if ((value & 0x80) != 0)
+    {
+        if (value != 0xF7)
+        {
+            FlushMidiEvent();
+            midi_write_status = value;
+            midi_write_needed = (value == 0xF0) ? -1 : ((((value & 0xF0) == 0xC0) || ((value & 0xF0) == 0xD0)) ? 1 : 2);
+        }
+    }
+    else if (midi_write_needed > 0)
     {
-        return 0xFF;
+        midi_write_needed--;
     }
 
-    event_time = 0;
-    for (index = 0; index < 4; index++)
-    {
-        event_time |= midi_data_buffer[read_index] << (8 * index);
-        read_index = (read_index + 1) & 0xFFFF;
+    midi_write_event.data[midi_write_event.length] = value;
+    midi_write_event.length++;
 
-        if (write_index == read_index)
+    if ((value == 0xF7) || (midi_write_needed == 0) || (midi_write_event.length == MIDI_EVENT_DATA))
+    {
+        FlushMidiEvent();
+        if (midi_write_needed == 0)
         {
-            midi_data_read_index = read_index;
-            return 0xFF;
+            // Running status, the next data bytes repeat the message
+            midi_write_needed = (((midi_write_status & 0xF0) == 0xC0) || ((midi_write_status & 0xF0) == 0xD0)) ? 1 : 2;
         }
     }
+}
+
+void VLSG::FlushMidiEvent(void)
+{
+    if (midi_write_event.length == 0) return;
 
-    time_2 = (system_time_1 >= 600000) ? (system_time_1 - 600000) : 0;
+    midi_write_event.offset = 0;
+    PostMidiEvent(&midi_write_event);
+    midi_write_event.length = 0;
+}
+
+// Writer side of the event ring. A full ring drops the event, the reader
+// catches up on its next ProcessMidiEvents.
+bool VLSG::PostMidiEvent(const Midi_Event* event)
+{
+    uint32_t write_index;
 
-    if ((system_time_1 + 600000 <= event_time) || (time_2 >= event_time))
+    write_index = midi_event_write_index.load(std::memory_order_relaxed);
+    if (write_index - midi_event_read_index.load(std::memory_order_acquire) >= MIDI_EVENT_RING_SIZE)
     {
-        AllVoicesSoundsOff();
-        midi_data_read_index = 0;
-        midi_data_write_index = 0;
-        return 0xFF;
+        return false;
     }
 
-    /*if (event_time + 100 > system_time_1)
+    midi_event_ring[write_index & (MIDI_EVENT_RING_SIZE - 1)] = *event;
+    midi_event_write_index.store(write_index + 1, std::memory_order_release);
+    return true;
+}
+
+// Reader side: applies the events in order up to the first one at or past
+// offset_limit.
+void VLSG::ProcessMidiEvents(uint32_t offset_limit)
+{
+    const Midi_Event* event;
+    uint32_t write_index, read_index;
+    int index;
+
+    read_index = midi_event_read_index.load(std::memory_order_relaxed);
+    write_index = midi_event_write_index.load(std::memory_order_acquire);
+
+    for (; read_index != write_index; read_index++)
     {
-        return 0xFF;
-    }*/
+        event = &(midi_event_ring[read_index & (MIDI_EVENT_RING_SIZE - 1)]);
+        if (event->offset >= offset_limit) break;
 
-    result = midi_data_buffer[read_index];
-    midi_data_read_index = (read_index + 1) & 0xFFFF;
-    return result;
+        for (index = 0; index < event->length; index++)
+        {
+            ProcessMidiByte(event->data[index]);
+        }
+    }
+
+    midi_event_read_index.store(read_index, std::memory_order_release);
 }
 
 bool VLSG::InitializePhase(void)
@@ -2448,80 +4289,56 @@ bool VLSG::EMPTY_DeinitializePhase(void)
 
 void VLSG::voice_set_panpot(Voice_Data *voice_data_ptr)
 {
-    voice_data_ptr->field_34 = sub_C0036FB0(voice_data_ptr->v_panpot >> 8);
-    voice_data_ptr->field_30 = sub_C0036FB0(voice_data_ptr->v_panpot & 0x1F);
+    int index = GetVoiceIndex(voice_data_ptr);
+
+    voice_mix.field_34[index] = sub_C0036FB0(voice_data_ptr->v_panpot >> 8);
+    voice_mix.field_30[index] = sub_C0036FB0(voice_data_ptr->v_panpot & 0x1F);
 }
 
 void VLSG::voice_set_flags(Voice_Data *voice_data_ptr)
 {
-    uint32_t offset1;
+    const Flags_Segment *segment;
+    uint32_t index;
 
-    offset1 = rom_change_bank(10, (voice_data_ptr->index >> 8) + voice_get_index(voice_data_ptr, voice_data_ptr->index & 0xFF));
-    offset1 += 4 * (voice_data_ptr->vflags & VFLAG_Mask07);
+    index = voice_get_template(voice_data_ptr)->flags_row + (voice_data_ptr->vflags & VFLAG_Mask07);
 
     if ((voice_data_ptr->vflags & VFLAG_MaskC0) == VFLAG_Value80)
     {
-        offset1 += 32;
+        index += 8;
     }
 
-    voice_data_ptr->field_48 = rom_read_word_at(offset1);
-    voice_data_ptr->field_4A = rom_read_word();
+    segment = &(wave_cache.flags_segments[index]);
+    voice_data_ptr->field_48 = segment->field_48;
+    voice_data_ptr->field_4A = segment->field_4A;
     voice_data_ptr->vflags = (voice_data_ptr->vflags & VFLAG_NotMask07) | (voice_data_ptr->field_48 & 7);
 }
 
 void VLSG::voice_set_flags2(Voice_Data *voice_data_ptr)
 {
-    uint32_t offset1;
+    const Flags2_Segment *segment;
+    uint32_t index;
     uint16_t value1;
-    int32_t value2;
-    int32_t value3;
 
-    offset1 = rom_change_bank(11, (voice_data_ptr->pgm_f14 >> 8) + voice_get_index(voice_data_ptr, voice_data_ptr->pgm_f14 & 0xFF));
-    offset1 += (voice_data_ptr->vflags & VFLAG_Mask38) >> 1;
+    index = voice_get_template(voice_data_ptr)->flags2_row + ((voice_data_ptr->vflags & VFLAG_Mask38) >> 3);
 
     if ((voice_data_ptr->vflags & VFLAG_MaskC0) == VFLAG_Value80)
     {
-        offset1 += 32;
+        index += 8;
     }
 
-    value1 = rom_read_word_at(offset1);
+    segment = &(wave_cache.flags2_segments[index]);
+    value1 = segment->v_vol;
     value1 = ((voice_data_ptr->v_velocity * (value1 >> 8)) & 0xFF00) | (value1 & 0xFF);
     voice_data_ptr->v_vol = value1;
 
     if ((((voice_data_ptr->vflags & VFLAG_Mask38) >> 3) == value1) && (voice_data_ptr->field_52 == 0))
     {
-        voice_data_ptr->note_number = 0xFF;
+        SetVoiceFree(GetVoiceIndex(voice_data_ptr));
         return;
     }
 
-    value2 = rom_read_word() >> 8;
-    if ((value2 & 0xE0) == 0x20)
-    {
-        value3 = (value2 & 0x1F) << 8;
-    }
-    else
-    {
-        value3 = value2;
-        if ((value2 & 0xE0) != 0)
-        {
-            value2 = (value2 >> 5) + 6;
-            value3 = (value3 & 0x1F) + 32;
-        }
-        else
-        {
-            value2 >>= 2;
-            value3 &= 3;
-        }
-        value3 <<= value2;
-    }
-
-    if (value3 > 0x7FFF)
-    {
-        value3 = 0x7FFF;
-    }
-
     voice_data_ptr->vflags = (voice_data_ptr->vflags & VFLAG_NotMask38) | ((voice_data_ptr->v_vol & 7) << 3);
-    voice_data_ptr->field_50 = value3;
+    voice_data_ptr->field_50 = segment->field_50;
 }
 
 void VLSG::voice_set_amp(Voice_Data *voice_data_ptr)
@@ -2529,111 +4346,116 @@ void VLSG::voice_set_amp(Voice_Data *voice_data_ptr)
     int32_t value0;
 
     value0 = channel_data[voice_data_ptr->channel_num_2 >> 1].expression * channel_data[voice_data_ptr->channel_num_2 >> 1].volume;
+    voice_data_ptr->amp_key = value0;
     value0 = ((int32_t)(value0 * value0)) >> 13;
     voice_data_ptr->vol = ((int32_t)(value0 * voice_data_ptr->wv_un3_lo)) >> 7;
 
     voice_set_panpot(voice_data_ptr);
 }
 
+// voice_set_amp, skipped when the channel's volume and expression did not
+// change since vol was last computed (v_panpot only changes at note on).
+inline void VLSG::voice_update_amp(Voice_Data *voice_data_ptr)
+{
+    if (channel_data[voice_data_ptr->channel_num_2 >> 1].expression * channel_data[voice_data_ptr->channel_num_2 >> 1].volume != voice_data_ptr->amp_key)
+    {
+        voice_set_amp(voice_data_ptr);
+    }
+}
+
 // Note: phase processing has to do with envelope states over time. do not over-process or the
 //       states will happen either too quickly or too slowly.
 void VLSG::ProcessPhase(void)
 {
-    int phase, index, value;
-    Channel_Data *channel;
-
-    phase = processing_phase & 7;
     processing_phase++;
+    period_start_frame = render_frame;
+    ProcessPhaseGroups((processing_phase - 1) & 7, 0xFFFFFFFFu);
+}
+
+// The control rate work of one phase of the 8 phase cycle, for the voices in
+// the phase groups of group_mask.
+void VLSG::ProcessPhaseGroups(uint32_t phase, uint32_t group_mask)
+{
+    int index, value;
+    Channel_Data *channel;
 
     switch ( phase )
     {
         case 0:
-            sub_C0037140();
+            sub_C0037140(group_mask);
 
-            for (index = 0; index < maximum_polyphony; index++)
+            for (index = NextPhaseVoice(0, group_mask); index < maximum_polyphony; index = NextPhaseVoice(index + 1, group_mask))
             {
-                if (voice_data[index].note_number != 255)
-                {
-                    voice_data[index].field_54 += dword_C0032188[voice_data[index].pgm_f10 + 112];
-                }
+                voice_data[index].field_54 += dword_C0032188[voice_data[index].pgm_f10 + 112];
             }
 
             break;
 
         case 1:
-            sub_C0037140();
-            sub_C0036FE0();
+            sub_C0037140(group_mask);
+            sub_C0036FE0(group_mask);
             break;
 
         case 2:
-            sub_C0037140();
+            sub_C0037140(group_mask);
             break;
 
         case 3:
-            sub_C0037140();
+            sub_C0037140(group_mask);
 
-            for (index = 0; index < maximum_polyphony; index++)
+            for (index = NextPhaseVoice(0, group_mask); index < maximum_polyphony; index = NextPhaseVoice(index + 1, group_mask))
             {
-                if (voice_data[index].note_number != 255)
+                channel = &(channel_data[voice_data[index].channel_num_2 >> 1]);
+                value = voice_data[index].pgm_f0E + channel->channel_pressure + channel->modulation;
+                if (value > 127)
                 {
-                    channel = &(channel_data[voice_data[index].channel_num_2 >> 1]);
-                    value = voice_data[index].pgm_f0E + channel->channel_pressure + channel->modulation;
-                    if (value > 127)
-                    {
-                        value = 127;
-                    }
-                    else if (value < 0)
-                    {
-                        value = 0;
-                    }
-
-                    voice_set_freq(&(voice_data[index]), (int16_t)(voice_data[index].base_freq + (((int32_t)(value * (voice_data[index].field_54 >> 8))) >> 7) + (voice_data[index].field_4C >> 3)));
+                    value = 127;
                 }
+                else if (value < 0)
+                {
+                    value = 0;
+                }
+
+                voice_update_freq(&(voice_data[index]), (int16_t)(voice_data[index].base_freq + (((int32_t)(value * (voice_data[index].field_54 >> 8))) >> 7) + (voice_data[index].field_4C >> 3)));
             }
 
             break;
 
         case 4:
-            for (index = 0; index < maximum_polyphony; index++)
+            for (index = NextPhaseVoice(0, group_mask); index < maximum_polyphony; index = NextPhaseVoice(index + 1, group_mask))
             {
-                if (voice_data[index].note_number != 255)
-                {
-                    voice_set_amp(&(voice_data[index]));
-                }
+                voice_update_amp(&(voice_data[index]));
             }
 
-            sub_C0037140();
+            sub_C0037140(group_mask);
             break;
 
         case 5:
-            sub_C0037140();
-            sub_C0036FE0();
+            sub_C0037140(group_mask);
+            sub_C0036FE0(group_mask);
             break;
 
         case 6:
-            sub_C0037140();
+            sub_C0037140(group_mask);
             break;
 
         case 7:
-            sub_C0037140();
+            sub_C0037140(group_mask);
 
-            for (index = 0; index < maximum_polyphony; index++)
+            for (index = NextPhaseVoice(0, group_mask); index < maximum_polyphony; index = NextPhaseVoice(index + 1, group_mask))
             {
-                if (voice_data[index].note_number != 255)
+                channel = &(channel_data[voice_data[index].channel_num_2 >> 1]);
+                value = voice_data[index].pgm_f0E + channel->channel_pressure + channel->modulation;
+                if (value > 127)
                 {
-                    channel = &(channel_data[voice_data[index].channel_num_2 >> 1]);
-                    value = voice_data[index].pgm_f0E + channel->channel_pressure + channel->modulation;
-                    if (value > 127)
-                    {
-                        value = 127;
-                    }
-                    else if (value < 0)
-                    {
-                        value = 0;
-                    }
-
-                    voice_set_freq(&(voice_data[index]), (int16_t)(voice_data[index].base_freq + (((int32_t)(value * (voice_data[index].field_54 >> 8))) >> 7) + (voice_data[index].field_4C >> 3)));
+                    value = 127;
+                }
+                else if (value < 0)
+                {
+                    value = 0;
                 }
+
+                voice_update_freq(&(voice_data[index]), (int16_t)(voice_data[index].base_freq + (((int32_t)(value * (voice_data[index].field_54 >> 8))) >> 7) + (voice_data[index].field_4C >> 3)));
             }
 
             break;
@@ -2673,15 +4495,13 @@ inline int32_t VLSG::sub_C0036FB0(int16_t value3)
 #endif
 }
 
-void VLSG::sub_C0036FE0(void) // ADSR envelope-related
+void VLSG::sub_C0036FE0(uint32_t group_mask) // ADSR envelope-related
 {
     int index;
     int32_t value1, value2, value3;
 
-    for (index = 0; index < maximum_polyphony; index++)
+    for (index = NextPhaseVoice(0, group_mask); index < maximum_polyphony; index = NextPhaseVoice(index + 1, group_mask))
     {
-        if (voice_data[index].note_number == 255) continue;
-
         value1 = voice_data[index].field_48;
         value2 = voice_data[index].field_4C;
         if (value1 > value2)
@@ -2719,64 +4539,278 @@ void VLSG::sub_C0036FE0(void) // ADSR envelope-related
     }
 }
 
-void VLSG::sub_C0037140(void)  // ADSR envelope-related
+// Voices started earlier in this period, between two phase group steps, took
+// their envelope step for it in StartPlayingVoice already.
+void VLSG::sub_C0037140(uint32_t group_mask)  // ADSR envelope-related
+{
+    for (int index = NextPhaseVoice(0, group_mask); index < maximum_polyphony; index = NextPhaseVoice(index + 1, group_mask))
+    {
+        if (voice_data[index].start_frame - period_start_frame < render_frame - period_start_frame)
+        {
+            continue;
+        }
+
+        UpdateVoiceEnvelope(index);
+    }
+}
+
+// One step of the amplitude envelope of a voice, towards the level of its
+// current stage.
+void VLSG::UpdateVoiceEnvelope(int index)
 {
     int choice, index2;
     int32_t value1, value2, value3;
 
-    for (int index = 0; index < maximum_polyphony; index++)
-    {
-        if (voice_data[index].note_number == 255) continue;
-
-        value1 = voice_data[index].field_52;
-        value2 = voice_data[index].field_50;
-        value3 = voice_data[index].v_vol & 0xFF00;
+    value1 = voice_data[index].field_52;
+    value2 = voice_data[index].field_50;
+    value3 = voice_data[index].v_vol & 0xFF00;
 
-        if (value3 > value1)
+    if (value3 > value1)
+    {
+        value1 += value2;
+        if (value1 > 32767)
         {
-            value1 += value2;
-            if (value1 > 32767)
-            {
-                value1 = 32767;
-            }
+            value1 = 32767;
+        }
 
-            choice = (value3 <= value1)?1:0;
+        choice = (value3 <= value1)?1:0;
+    }
+    else
+    {
+        value1 -= value2;
+        if (value1 < -32767)
+        {
+            value1 = -32767;
         }
-        else
+
+        choice = (value3 >= value1)?1:0;
+    }
+
+    if (choice)
+    {
+        voice_data[index].field_52 = value3;
+        index2 = (value3 & 0x7fff) >> 11;
+        voice_data[index].field_28 = word_C00342D0[index2] + (((int32_t)((word_C00342D0[index2 + 1] - word_C00342D0[index2]) * (value3 & 0x07ff))) >> 11);
+        voice_set_flags2(&(voice_data[index]));
+    }
+    else
+    {
+        voice_data[index].field_52 = value1;
+        index2 = (value1 & 0x7fff) >> 11;
+        voice_data[index].field_28 = word_C00342D0[index2] + (((int32_t)((word_C00342D0[index2 + 1] - word_C00342D0[index2]) * (value1 & 0x07ff))) >> 11);
+    }
+
+    voice_mix.field_38[index] = ((int32_t)(voice_data[index].field_28 * voice_data[index].vol)) >> 14;
+    UpdateVoicePriority(index);
+}
+
+// Whole bitmap words of voices, see LayoutVoicePool.
+static inline int32_t RoundVoicePool(int32_t voices)
+{
+    voices = (voices + 31) & ~31;
+    if (voices < 32) voices = 32;
+    if (voices > MAX_VOICES) voices = MAX_VOICES;
+    return voices;
+}
+
+// Sizes the voice arrays for voice_pool_requested voices, or the polyphony
+// asked for so far, and allocates them as one block unless the last one fits
+// the same count. Polyphony above it is capped until the next
+// VLSG_PlaybackStart or VLSG_ResizeVoicePool.
+bool VLSG::InitializeVoicePool(void)
+{
+    int32_t capacity;
+    size_t bytes;
+    int index;
+
+    capacity = RoundVoicePool((voice_pool_requested != 0) ? (int32_t)voice_pool_requested : polyphony_requested.load());
+
+    if ((voice_pool_memory == nullptr) || (capacity != voice_capacity))
+    {
+        DeinitializeVoicePool();
+
+        bytes = LayoutVoicePool(nullptr, capacity);
+        voice_pool_memory = ::operator new(bytes, std::align_val_t(64), std::nothrow);
+        if (voice_pool_memory == nullptr)
         {
-            value1 -= value2;
-            if (value1 < -32767)
-            {
-                value1 = -32767;
-            }
+            LayoutVoicePool(nullptr, 0);
+            return false;
+        }
+        memset(voice_pool_memory, 0, bytes);
+        LayoutVoicePool((uint8_t*)voice_pool_memory, capacity);
+        voice_capacity = capacity;
 
-            choice = (value3 >= value1)?1:0;
+        // v_freq is computed on the first phase, see VLSG_SetFrequency
+        for (index = 0; index < capacity; index++)
+        {
+            voice_data[index].freq_key = INT32_MIN;
         }
+    }
+
+    if (maximum_polyphony > voice_capacity) maximum_polyphony = voice_capacity;
+    if (maximum_polyphony_new_value > voice_capacity) maximum_polyphony_new_value = voice_capacity;
+    return true;
+}
+
+// Grows the voice arrays of a started synth to hold voices, keeping the voices
+// that play and the channel and program state, and lifts the polyphony cap to
+// match. Nothing may render or take MIDI meanwhile. The old arrays are kept if
+// the new ones can't be allocated.
+bool VLSG::VLSG_ResizeVoicePool(unsigned int voices)
+{
+    Voice_Data* old_voice_data = voice_data;
+    Voice_Mix_Data old_voice_mix = voice_mix;
+    uint32_t* old_voice_active = voice_active;
+    uint32_t* old_channel_voices[MIDI_CHANNELS];
+    uint32_t* old_priority_voices[VOICE_PRIORITIES];
+    int16_t* old_note_voice_next = note_voice_next;
+    int16_t* old_note_voice_prev = note_voice_prev;
+    uint8_t* old_voice_priority = voice_priority;
+    void* old_memory = voice_pool_memory;
+    int32_t old_capacity = voice_capacity;
+    size_t old_words = old_capacity / 32;
+    int32_t capacity;
+    int32_t polyphony;
+    size_t bytes;
+    int index;
+
+    if ((voices > MAX_VOICES) || (old_memory == nullptr))
+    {
+        return false;
+    }
+
+    capacity = RoundVoicePool((int32_t)voices);
+    if (capacity > old_capacity)
+    {
+        memcpy(old_channel_voices, channel_voices, sizeof(old_channel_voices));
+        memcpy(old_priority_voices, priority_voices, sizeof(old_priority_voices));
 
-        if (choice)
+        bytes = LayoutVoicePool(nullptr, capacity);
+        voice_pool_memory = ::operator new(bytes, std::align_val_t(64), std::nothrow);
+        if (voice_pool_memory == nullptr)
         {
-            voice_data[index].field_52 = value3;
-            index2 = (value3 & 0x7fff) >> 11;
-            voice_data[index].field_28 = word_C00342D0[index2] + (((int32_t)((word_C00342D0[index2 + 1] - word_C00342D0[index2]) * (value3 & 0x07ff))) >> 11);
-            voice_set_flags2(&(voice_data[index]));
+            voice_pool_memory = old_memory;
+            LayoutVoicePool((uint8_t*)old_memory, old_capacity);
+            return false;
         }
-        else
+        memset(voice_pool_memory, 0, bytes);
+        LayoutVoicePool((uint8_t*)voice_pool_memory, capacity);
+
+        // Voice indexes stay the same, so note_voice_head and the lists keep pointing right
+        memcpy(voice_data, old_voice_data, old_capacity * sizeof(Voice_Data));
+        memcpy(voice_mix.wv_fpos, old_voice_mix.wv_fpos, old_capacity * sizeof(uint32_t));
+        memcpy(voice_mix.wv_end, old_voice_mix.wv_end, old_capacity * sizeof(uint32_t));
+        memcpy(voice_mix.wv_start, old_voice_mix.wv_start, old_capacity * sizeof(uint32_t));
+        memcpy(voice_mix.wv_base, old_voice_mix.wv_base, old_capacity * sizeof(uint32_t));
+        memcpy(voice_mix.v_freq, old_voice_mix.v_freq, old_capacity * sizeof(uint32_t));
+        memcpy(voice_mix.field_2C, old_voice_mix.field_2C, old_capacity * sizeof(int32_t));
+        memcpy(voice_mix.field_30, old_voice_mix.field_30, old_capacity * sizeof(int32_t));
+        memcpy(voice_mix.field_34, old_voice_mix.field_34, old_capacity * sizeof(int32_t));
+        memcpy(voice_mix.field_38, old_voice_mix.field_38, old_capacity * sizeof(int32_t));
+        memcpy(voice_mix.v_stack, old_voice_mix.v_stack, old_capacity * sizeof(int32_t));
+        memcpy(voice_active, old_voice_active, old_words * sizeof(uint32_t));
+        for (index = 0; index < MIDI_CHANNELS; index++)
+        {
+            memcpy(channel_voices[index], old_channel_voices[index], old_words * sizeof(uint32_t));
+        }
+        for (index = 0; index < VOICE_PRIORITIES; index++)
+        {
+            memcpy(priority_voices[index], old_priority_voices[index], old_words * sizeof(uint32_t));
+        }
+        memcpy(note_voice_next, old_note_voice_next, old_capacity * sizeof(int16_t));
+        memcpy(note_voice_prev, old_note_voice_prev, old_capacity * sizeof(int16_t));
+        memcpy(voice_priority, old_voice_priority, old_capacity * sizeof(uint8_t));
+
+        ::operator delete(old_memory, std::align_val_t(64));
+        voice_capacity = capacity;
+
+        for (index = old_capacity; index < capacity; index++)
         {
-            voice_data[index].field_52 = value1;
-            index2 = (value1 & 0x7fff) >> 11;
-            voice_data[index].field_28 = word_C00342D0[index2] + (((int32_t)((word_C00342D0[index2 + 1] - word_C00342D0[index2]) * (value1 & 0x07ff))) >> 11);
+            SetVoiceFree(index);
+            voice_data[index].freq_key = INT32_MIN;
         }
+    }
+
+    polyphony = polyphony_requested;
+    maximum_polyphony = (polyphony < voice_capacity) ? polyphony : voice_capacity;
+    maximum_polyphony_new_value = maximum_polyphony;
+    return true;
+}
+
+// Voice threads only touch the pool while the audio thread waits for them.
+void VLSG::DeinitializeVoicePool(void)
+{
+    if (voice_pool_memory != nullptr)
+    {
+        ::operator delete(voice_pool_memory, std::align_val_t(64));
+        voice_pool_memory = nullptr;
+    }
+    LayoutVoicePool(nullptr, 0);
+    voice_capacity = 0;
+}
 
-        voice_data[index].field_38 = ((int32_t)(voice_data[index].field_28 * voice_data[index].vol)) >> 14;
+// Points the voice arrays into base, each starting a cache line, and returns
+// the bytes they take. With base nullptr only the size is worked out and the
+// arrays are left null.
+size_t VLSG::LayoutVoicePool(uint8_t *base, int32_t capacity)
+{
+    size_t offset = 0;
+    size_t words = capacity / 32;
+    int index;
+
+    auto take = [&](size_t size) -> void*
+    {
+        void *block = (base != nullptr) ? (base + offset) : nullptr;
+        offset += (size + 63) & ~(size_t)63;
+        return block;
+    };
+
+    voice_data = (Voice_Data*)take(capacity * sizeof(Voice_Data));
+    voice_mix.wv_fpos = (uint32_t*)take(capacity * sizeof(uint32_t));
+    voice_mix.wv_end = (uint32_t*)take(capacity * sizeof(uint32_t));
+    voice_mix.wv_start = (uint32_t*)take(capacity * sizeof(uint32_t));
+    voice_mix.wv_base = (uint32_t*)take(capacity * sizeof(uint32_t));
+    voice_mix.v_freq = (uint32_t*)take(capacity * sizeof(uint32_t));
+    voice_mix.field_2C = (int32_t*)take(capacity * sizeof(int32_t));
+    voice_mix.field_30 = (int32_t*)take(capacity * sizeof(int32_t));
+    voice_mix.field_34 = (int32_t*)take(capacity * sizeof(int32_t));
+    voice_mix.field_38 = (int32_t*)take(capacity * sizeof(int32_t));
+    voice_mix.v_stack = (int32_t*)take(capacity * sizeof(int32_t));
+    voice_active = (uint32_t*)take(words * sizeof(uint32_t));
+    for (index = 0; index < MIDI_CHANNELS; index++)
+    {
+        channel_voices[index] = (uint32_t*)take(words * sizeof(uint32_t));
+    }
+    for (index = 0; index < VOICE_PRIORITIES; index++)
+    {
+        priority_voices[index] = (uint32_t*)take(words * sizeof(uint32_t));
     }
+    note_voice_next = (int16_t*)take(capacity * sizeof(int16_t));
+    note_voice_prev = (int16_t*)take(capacity * sizeof(int16_t));
+    voice_priority = (uint8_t*)take(capacity * sizeof(uint8_t));
+    for (index = 0; index <= MAX_VOICE_THREADS; index++)
+    {
+        voice_thread_data[index].ended = (int16_t*)take(capacity * sizeof(int16_t));
+    }
+
+    return offset;
 }
 
 bool VLSG::InitializeStructures(void)
 {
     int index;
 
-    for (index = 0; index < MAX_VOICES; index++)
-        voice_data[index].note_number = 255;
+    memset(voice_active, 0, (voice_capacity / 32) * sizeof(uint32_t));
+    for (index = 0; index < MIDI_CHANNELS; index++)
+        memset(channel_voices[index], 0, (voice_capacity / 32) * sizeof(uint32_t));
+    memset(note_voice_head, 0xFF, sizeof(note_voice_head));
+    for (index = 0; index < VOICE_PRIORITIES; index++)
+        memset(priority_voices[index], 0, (voice_capacity / 32) * sizeof(uint32_t));
+    memset(priority_counts, 0, sizeof(priority_counts));
+    memset(channel_serial, 0, sizeof(channel_serial));
+    priority_used = 0;
+    for (index = 0; index < voice_capacity; index++)
+        SetVoiceFree(index);
 
     for (index = 0; index < MIDI_CHANNELS; index++)
     {
@@ -30,8 +30,21 @@
 #include <cstring>
 #include <climits>
 #include <cmath>
+#include <map>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include "IPlug_include_in_plug_hdr.h"
 
+#if defined(_WIN32)
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
 #ifdef _MSC_VER
 #define inline __inline
 #include <intrin.h>
@@ -39,7 +52,21 @@
 
 #define MIDI_CHANNELS 16
 #define DRUM_CHANNEL 9
-#define MAX_VOICES 256  // hehehe
+#define MAX_VOICES 4096  // largest voice pool, see InitializeVoicePool
+#define VOICE_PRIORITIES 32  // stealing order buckets, see UpdateVoicePriority
+#define PHASE_GROUPS 8  // VLSG_BufferVst runs ProcessPhase for voice slot n in group n % PHASE_GROUPS
+#define PHASE_GROUP_MASK(group) (0x01010101u << (group))  // slots of a group within each voice_active word
+#define ROM_SIZE (2 * 1024 * 1024)  // original ROM always 2MB, a custom ROM may need this changed
+#define REVERB_BUFFER_SIZE 5632  // delay lines of ProcessReverb
+#define REVERB_BLOCK_SIZE 128  // samples per ProcessReverb call, at most the shortest delay (137)
+#define REVERB_PIPELINE_SLOTS 4  // power of two, see RunReverbPipeline
+#define REVERB_PIPELINE_LATENCY (2 * REVERB_BLOCK_SIZE)
+#define MAX_VOICE_THREADS 7  // workers besides the audio thread, see MixVoiceBlock
+#define VOICE_THREAD_MIN_LANES 16  // fewer voice lanes per thread are not worth a handoff
+#define MIDI_EVENT_RING_SIZE 4096  // power of two, see PostMidiEvent
+#define MIDI_EVENT_DATA 5
+#define MIDI_BATCH_SIZE 16384  // most channel messages VLSG_BufferVst takes per call, see IngestMidiQueue
+#define VOICE_STACK_LIMIT 1024  // notes one voice may play, see StackVoice
 
 
 typedef struct
@@ -61,20 +88,153 @@ typedef struct
   uint8_t data_entry_LSB;
 } Channel_Data;
 
+// Per-voice state read by the mixer on every output sample, stored as one array
+// per field so the sample loop only pulls these into cache (Voice_Data holds the rest).
+// Each array is on its own cache lines in the voice pool, see LayoutVoicePool.
+typedef struct
+{
+  uint32_t* wv_fpos;
+  uint32_t* wv_end;
+  uint32_t* wv_start;
+  uint32_t* wv_base;  // wave_cache_samples index of ROM sample 0 for the current pass
+  uint32_t* v_freq;
+  int32_t* field_2C;
+  int32_t* field_30;
+  int32_t* field_34;
+  int32_t* field_38;
+  int32_t* v_stack;  // notes the voice plays at once, 1 unless PARAMETER_VoiceStacking
+} Voice_Mix_Data;
+
+// Where a bank 2 wave lives in the decoded sample cache. The sample at ROM
+// address N is at wave_cache_samples[bias + N], separately for the first pass
+// from the wave start and for the passes after looping back to the loop start.
+// The rest of the bank 2 entry is kept alongside for StartPlayingVoice.
+typedef struct
+{
+  uint32_t first_bias;
+  uint32_t loop_bias;
+  bool valid;
+  uint32_t start;
+  uint32_t end;
+  uint32_t loop_start;
+  uint16_t wv_un1;
+  int16_t base_freq;
+  uint8_t wv_un3_lo;
+} Wave_Cache_Entry;
+
+// ROM lookups for one program part playing one (transposed) note: the bank 2
+// wave and the bank 10 and 11 envelope rows used by voice_set_flags and
+// voice_set_flags2, as indexes of their first segment.
+typedef struct
+{
+  int32_t wave_index;
+  uint32_t flags_row;
+  uint32_t flags2_row;
+} Note_Template;
+
+// A bank 10 or bank 11 envelope row holds 8 stages, then 8 more used once the
+// voice is released; each is expanded into one of these at ROM load.
+#define ENVELOPE_ROW_SEGMENTS 16
+
+typedef struct
+{
+  int16_t field_48;
+  int16_t field_4A;
+} Flags_Segment;
+
+typedef struct
+{
+  uint16_t v_vol;  // before velocity scaling
+  int16_t field_50;
+} Flags2_Segment;
+
+// What the engine reads of the wave cache. It points either into the vectors
+// InitializeWaveCache fills or into a mapped cache file, see MapWaveCacheFile.
+typedef struct
+{
+  const int16_t* samples;
+  const Wave_Cache_Entry* entries;
+  uint32_t entry_count;
+  const Note_Template* note_templates;
+  const Flags_Segment* flags_segments;
+  const Flags2_Segment* flags2_segments;
+} Wave_Cache_Tables;
+
+// Start of a cache file. The tables follow in the order of the counts, each
+// at a multiple of 64 bytes.
+#define WAVE_CACHE_FILE_MAGIC 0x43574C56  // "VLWC"
+#define WAVE_CACHE_FILE_VERSION 1  // bump whenever the tables are built differently
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t rom_checksum;
+  uint16_t struct_sizes[4];  // Wave_Cache_Entry, Note_Template, Flags_Segment, Flags2_Segment
+  uint32_t sample_count;
+  uint32_t entry_count;
+  uint32_t note_template_count;
+  uint32_t flags_segment_count;
+  uint32_t flags2_segment_count;
+  uint32_t file_size;
+} Wave_Cache_File_Header;
+
+// A MIDI message, or up to MIDI_EVENT_DATA bytes of a longer SysEx, in the ring
+// between the thread writing MIDI and the one rendering it.
+typedef struct
+{
+  uint16_t offset;  // frame into the output of the next VLSG_Buffer
+  uint8_t length;
+  uint8_t data[MIDI_EVENT_DATA];
+} Midi_Event;
+
+// A channel message VLSG_BufferVst took off its IMidiQueue. Those dropped by
+// CoalesceMidiBatch stay in place with status 0.
+typedef struct
+{
+  uint32_t offset;
+  uint8_t status;
+  uint8_t data1;
+  uint8_t data2;
+} Midi_Batch_Event;
+
+// What the MIDI ingestion of VLSG_BufferVst did since VLSG_PlaybackStart.
+typedef struct
+{
+  uint64_t received;    // channel messages taken off the queue
+  uint64_t merged;      // controller, bend and pressure values overwritten before anything read them
+  uint64_t cancelled;   // note on and note off pairs removed, MIDIBATCH_CancelNotes
+  uint64_t duplicates;  // repeated note ons at the same frame removed, MIDIBATCH_CancelNotes
+  uint64_t overflowed;  // dropped past PARAMETER_MidiBatchSize messages in one call
+} Midi_Batch_Stats;
+
+// A block of mixed samples handed to the reverb worker thread, with the reverb
+// settings at the time it was mixed.
+typedef struct
+{
+  int32_t left[REVERB_BLOCK_SIZE];
+  int32_t right[REVERB_BLOCK_SIZE];
+  int32_t is_reverb_enabled;
+  uint32_t reverb_shift;
+  uint32_t reverb_clear_count;
+} Reverb_Pipeline_Slot;
+
+// One thread's share of the voices mixed by MixVoiceBlock and what it mixed.
+typedef struct
+{
+  alignas(64) int32_t left[REVERB_BLOCK_SIZE];
+  int32_t right[REVERB_BLOCK_SIZE];
+  int range_start[MAX_VOICES / 64];
+  int range_end[MAX_VOICES / 64];
+  int range_count;
+  bool wrap_pending;
+  int ended_count;
+  int16_t* ended;  // voices whose wave ended, for the audio thread to free; voice pool sized
+} Voice_Thread_Data;
+
 typedef struct
 {
-  uint32_t wv_fpos;
-  uint32_t wv_end;
-  uint32_t wv_start;
-  int32_t field_0C[4];
-  uint32_t wv_un3_hi;
-  uint32_t wv_pos;
-  uint32_t v_freq;
   int32_t field_28;
-  int32_t field_2C;
-  int32_t field_30;
-  int32_t field_34;
-  int32_t field_38;
   int32_t note_number;
   int16_t note_velocity;
   int16_t channel_num_2;
@@ -98,6 +258,12 @@ typedef struct
   int16_t wv_un1_lo;
   int16_t wv_un1_hi;
   int16_t v_panpot;
+  uint32_t wv_loop_base;
+  uint16_t template_row;  // = pgm.template_row
+  int32_t freq_key;  // pitch table index v_freq was last computed from
+  int32_t amp_key;   // expression * volume vol was last computed from
+  uint32_t start_frame;   // render_frame at the note on
+  uint32_t start_serial;  // channel_serial at the note on
 } Voice_Data;
 
 typedef struct
@@ -116,6 +282,7 @@ typedef struct
   int16_t  field_16;
   int16_t  field_18;
   int16_t  field_1A;
+  uint16_t template_row;  // note_templates row, 2 * program number + part
 } Program_Data;
 
 
@@ -127,6 +294,31 @@ enum ParameterType
     PARAMETER_Polyphony     = 4,
     PARAMETER_Effect        = 5,
     PARAMETER_VelocityFunc  = 6, // Experimental
+    PARAMETER_ReverbPipeline = 7, // Experimental, delays the output by VLSG_GetLatency()
+    PARAMETER_VoiceThreads  = 8, // Experimental, worker threads mixing voices
+    PARAMETER_CacheFile     = 9, // Optional, path of the wave cache file (const char*)
+    PARAMETER_TimeSource    = 10, // One of Time_Source
+    PARAMETER_MidiBatch     = 11, // Midi_Batch_Flags
+    PARAMETER_VoicePool     = 12, // Voices allocated by the next VLSG_PlaybackStart, 0 for the polyphony
+    PARAMETER_VoiceStacking = 13, // Experimental, identical notes started together share a voice
+    PARAMETER_MidiBatchSize = 14, // Channel messages VLSG_BufferVst takes per call, up to MIDI_BATCH_SIZE (default)
+};
+
+// Where VLSG_GetTime takes its milliseconds from. On the sample clock time only
+// passes as frames are rendered, so rendering is reproducible and never slows
+// down or speeds up MIDI handling and voice reduction.
+enum Time_Source
+{
+    TIMESRC_Function = 0, // VLSG_SetFunc_GetTime, the default
+    TIMESRC_Samples  = 1, // frames rendered since VLSG_PlaybackStart
+};
+
+// How VLSG_BufferVst thins out the MIDI it applies between two ProcessPhase
+// steps of the voices, for very dense input.
+enum Midi_Batch_Flags
+{
+    MIDIBATCH_MergeControllers = 0x01, // only the last volume, pan, bend, ... update counts, the output is unchanged (default)
+    MIDIBATCH_CancelNotes      = 0x02, // drops notes released before their first step and repeated note ons
 };
 
 
@@ -169,9 +361,30 @@ inline uint16_t READ_LE_UINT16(const uint8_t* ptr)
   return ptr[0] | (ptr[1] << 8);
 }
 
+// Wakes a worker thread parked in Wait. Post takes no lock, and a post made
+// before the worker waits is kept for it rather than lost.
+class VLSG_Semaphore
+{
+public:
+  VLSG_Semaphore();
+  ~VLSG_Semaphore();
+  void Post(void);
+  void Wait(void);
+
+private:
+#if defined(_WIN32)
+  void* handle;
+#elif defined(__APPLE__)
+  dispatch_semaphore_t handle;  // unnamed POSIX semaphores are not implemented on macOS
+#else
+  sem_t handle;
+#endif
+};
+
 class VLSG
 {
 public:
+  ~VLSG();
   constexpr uint32_t VLSG_GetVersion(void) const;
   constexpr const char* VLSG_GetName(void) const;
   uint32_t VLSG_GetTime(void);
@@ -183,18 +396,32 @@ public:
   bool VLSG_SetPolyphony(unsigned int poly);
   bool VLSG_SetEffect(unsigned int effect);
   bool VLSG_SetVelocityFunc(unsigned int curveIdx);
+  bool VLSG_SetReverbPipeline(bool enable);
+  bool VLSG_SetVoiceThreads(unsigned int count);
+  bool VLSG_SetCacheFile(const char* path);
+  bool VLSG_SetTimeSource(uint32_t source);
+  bool VLSG_SetMidiBatch(uint32_t flags);
+  bool VLSG_SetMidiBatchSize(unsigned int size);
+  bool VLSG_SetVoicePool(unsigned int voices);
+  bool VLSG_ResizeVoicePool(unsigned int voices);
+  bool VLSG_SetVoiceStacking(bool enable);
+  int32_t VLSG_GetVoicePool(void) const;
+  int32_t VLSG_GetPolyphony(void) const;
+  Midi_Batch_Stats VLSG_GetMidiBatchStats(void) const;
+  int32_t VLSG_GetLatency(void) const;
   bool VLSG_PlaybackStart(void);
   bool VLSG_PlaybackStop(void);
   void VLSG_Write(const void* data, uint32_t len);
+  bool VLSG_PostMidi(const uint8_t* data, uint32_t len, uint32_t offset);
   int32_t VLSG_Buffer(uint32_t output_buffer_counter);
   void VLSG_AddMidiData(uint8_t* ptr, uint32_t len);
 
   // Invasive workarounds
   int32_t VLSG_BufferVst(uint32_t output_buffer_counter, double** output, int nFrames, iplug::IMidiQueue& mMidiQueue, iplug::IMidiQueueBase<iplug::ISysEx>& mSysExQueue);
   void ProcessMidiData(void);
-  inline void ProcessMidiDataVst(iplug::IMidiMsg& msg);   // TODO adapt for pluggable queue
   inline void ProcessSysExDataVst(iplug::ISysEx& msg);    // TODO adapt for pluggable queue
   void ProcessPhase(void);
+  void ProcessPhaseGroups(uint32_t phase, uint32_t group_mask);
 
 private:
   uint32_t dword_C0000000;
@@ -202,29 +429,73 @@ private:
   uint32_t dword_C0000008;
   int32_t output_size_para;
   int phaseAcc = INT_MIN;
+  uint32_t phase_group = 0;  // next phase group VLSG_BufferVst runs in the current period
+  uint32_t phase_groups_due = 0xFFFFFFFFu;  // groups whose ProcessPhase step follows the MIDI being applied
+  uint32_t period_start_frame = 0;  // render_frame at the start of the current period, see sub_C0037140
   uint32_t system_time_2;
   uint8_t event_data[256];
   uint32_t recent_voice_index;
-  Program_Data* program_data_ptr;
-  Channel_Data* channel_data_ptr;
   uint32_t event_type;
   int32_t event_length = 0;
-  int32_t reverb_data_buffer[32768];
+  int32_t reverb_data_buffer[REVERB_BUFFER_SIZE];
   uint32_t reverb_data_index;
+  int32_t reverb_comb_value[2];  // last output of each comb filter
+  uint32_t reverb_clear_count = 0;  // DisableReverb calls
   int32_t is_reverb_enabled;
   uint32_t reverb_shift;
-  volatile uint32_t midi_data_read_index;
-  uint8_t midi_data_buffer[65536];
-  volatile uint32_t midi_data_write_index;
+  // Single writer, single reader; each index is only stored by its own side.
+  Midi_Event midi_event_ring[MIDI_EVENT_RING_SIZE];
+  alignas(64) std::atomic<uint32_t> midi_event_write_index{0};
+  alignas(64) std::atomic<uint32_t> midi_event_read_index{0};
+  // Writer side framing of VLSG_Write's timestamp and byte records
+  Midi_Event midi_write_event;
+  uint32_t midi_write_record_length;  // bytes of the current record seen
+  uint32_t midi_write_status;
+  int32_t midi_write_needed;  // data bytes until the message is complete, -1 for SysEx
+  // Channel messages of the current VLSG_BufferVst call, see IngestMidiQueue.
+  // One block of twice midi_batch_capacity events, allocated by InitializeMidiDataBuffer.
+  Midi_Batch_Event* midi_batch = nullptr;
+  Midi_Batch_Event* midi_batch_sorted = nullptr;  // SortMidiBatch scratch
+  uint32_t midi_batch_capacity = 0;
+  uint32_t midi_batch_size_requested = MIDI_BATCH_SIZE;  // VLSG_SetMidiBatchSize
+  uint32_t midi_batch_count = 0;
+  uint32_t midi_batch_index = 0;  // next one to apply
+  uint32_t midi_batch_coalesced = 0;  // CoalesceMidiBatch has seen the ones before
+  uint32_t midi_batch_flags = MIDIBATCH_MergeControllers;
+  int16_t midi_batch_note_on[MIDI_CHANNELS][128];  // batch index of an unreleased note on, -1 for none
+  std::atomic<uint64_t> midi_batch_received{0};
+  std::atomic<uint64_t> midi_batch_merged{0};
+  std::atomic<uint64_t> midi_batch_cancelled{0};
+  std::atomic<uint64_t> midi_batch_duplicates{0};
+  std::atomic<uint64_t> midi_batch_overflowed{0};
   uint32_t processing_phase;
+  uint32_t render_frame;  // frames rendered since VLSG_PlaybackStart, see StackVoice
+  uint32_t channel_serial[MIDI_CHANNELS];  // bumped by every message but notes, see StackVoice
+  bool voice_stacking = false;
   uint32_t rom_offset;
   Program_Data program_data[MIDI_CHANNELS * 2];
   Channel_Data channel_data[MIDI_CHANNELS];
-  Voice_Data voice_data[MAX_VOICES];
+  // Voice arrays of voice_capacity slots each, in one block allocated by InitializeVoicePool
+  Voice_Data* voice_data = nullptr;
+  Voice_Mix_Data voice_mix = {};
+  uint32_t* voice_active = nullptr;
+  uint32_t* channel_voices[MIDI_CHANNELS] = {};
+  int16_t note_voice_head[MIDI_CHANNELS * 2][128];  // active voices per channel_num_2 and note_number, -1 terminated
+  int16_t* note_voice_next = nullptr;
+  int16_t* note_voice_prev = nullptr;
+  uint32_t* priority_voices[VOICE_PRIORITIES] = {};
+  int32_t priority_counts[VOICE_PRIORITIES];  // voices in each priority_voices bucket
+  uint32_t priority_used;  // bit set for each non-empty priority_voices bucket
+  uint8_t* voice_priority = nullptr;
+  void* voice_pool_memory = nullptr;
+  int32_t voice_capacity = 0;  // a multiple of 32, polyphony above it is capped
+  uint32_t voice_pool_requested = 0;  // VLSG_SetVoicePool
+  std::atomic<int32_t> polyphony_requested{0};  // last polyphony asked for, before the cap, set by SysEx too
   uint32_t velocity_func;
   int32_t current_polyphony;
   const uint8_t* romsxgm_ptr;
   uint32_t output_frequency;
+  uint64_t output_frequency_reciprocal;  // 2^46 / output_frequency, rounded up
   int32_t maximum_polyphony_new_value;
   uint32_t system_time_1;
   int32_t maximum_polyphony;
@@ -233,36 +504,120 @@ private:
   uint32_t output_buffer_size_bytes;
   uint32_t effect_param_value;
   int32_t* reverb_data_ptr = nullptr;
+  // Reverb on a worker thread, see RunReverbPipeline
+  std::atomic<bool> reverb_pipeline_requested{false};
+  bool reverb_pipeline_active = false;
+  Reverb_Pipeline_Slot reverb_pipeline_slots[REVERB_PIPELINE_SLOTS];
+  uint32_t reverb_pipeline_slot = 0;  // slot being mixed into
+  uint32_t reverb_pipeline_position = 0;
+  std::atomic<uint32_t> reverb_pipeline_published{0};  // slots handed to the worker
+  std::atomic<uint32_t> reverb_pipeline_done{0};  // slots the worker has finished
+  uint32_t reverb_worker_clear_count = 0;
+  std::atomic<bool> reverb_worker_exit{false};
+  std::atomic<bool> reverb_worker_sleeping{false};  // parked in reverb_worker_wake, see ReverbWorker
+  VLSG_Semaphore reverb_worker_wake;
+  std::thread reverb_worker;
+  // Voice mixing on worker threads, see MixVoiceBlock
+  std::atomic<int> voice_threads_requested{0};
+  std::atomic<int> voice_threads_started{0};
+  int voice_thread_count = 0;  // workers the audio thread hands voices to
+  Voice_Thread_Data voice_thread_data[MAX_VOICE_THREADS + 1];  // [0] is the audio thread's share
+  std::atomic<uint32_t> voice_job_serial{0};  // counts jobs from bit 4 up, low bits are the workers in the job
+  std::atomic<int> voice_job_done{0};
+  uint32_t voice_job_frames = 0;
+  std::atomic<bool> voice_threads_exit{false};
+  std::atomic<bool> voice_thread_sleeping[MAX_VOICE_THREADS] = {};  // parked in voice_thread_wake, see VoiceWorker
+  VLSG_Semaphore voice_thread_wake[MAX_VOICE_THREADS];
+  std::thread voice_threads[MAX_VOICE_THREADS];
+  std::vector<int16_t> wave_cache_samples;
+  std::vector<Wave_Cache_Entry> wave_cache_index;
+  std::vector<Note_Template> note_templates;
+  std::vector<Flags_Segment> flags_segments;
+  std::vector<Flags2_Segment> flags2_segments;
+  const uint8_t* wave_cache_rom = nullptr;
+  Wave_Cache_Tables wave_cache = {};
+  std::string wave_cache_path;
+  void* wave_cache_file_data = nullptr;  // mapped cache file, if wave_cache points into it
+  size_t wave_cache_file_size = 0;
+  bool voice_wrap_pending = false;
   uint32_t(*get_time_func)();
+  uint32_t time_source = TIMESRC_Function;
+  std::atomic<uint32_t> sample_clock_time{0};  // ms, see AdvanceSampleClock
+  uint32_t sample_clock_fraction = 0;  // ms * output_frequency not yet counted
 
   bool InitializeVelocityFunc(void);
   constexpr bool EMPTY_DeinitializeVelocityFunc(void);
   bool InitializeVariables(void);
   constexpr bool EMPTY_DeinitializeVariables(void);
   inline void CountActiveVoices(void);
+  inline void SetVoiceActive(int index);
+  inline void SetVoiceFree(int index);
+  inline void ParkVoice(int index);
+  inline int NextActiveVoice(int index, int limit) const;
+  inline int NextPhaseVoice(int index, uint32_t group_mask) const;
+  inline int NextChannelVoice(int32_t channel_num, int index, int limit) const;
+  inline void SetVoicePriority(int index, int priority);
+  inline void UpdateVoicePriority(int index);
+  inline int FindFreeVoice(int limit, uint32_t group_mask = 0xFFFFFFFFu) const;
+  inline int GetActiveVoiceRanges(int* range_start, int* range_end) const;
   void SetMaximumVoices(int maximum_voices);
   Voice_Data* FindAvailableVoice(int32_t channel_num_2, int32_t note_number);
   Voice_Data* FindVoice(int32_t channel_num_2, int32_t note_number);
-  void NoteOff(void);
-  void NoteOn(int32_t ch);
-  void ControlChange(void);
+  bool StackVoice(int32_t channel_num_2, int32_t note_number, int32_t velocity);
+  Voice_Data* UnstackVoice(Voice_Data* voice_data_ptr);
+  int FindUnstackVoice(int index);
+  void ProcessChannelMessage(uint8_t status, uint8_t data1, uint8_t data2);
+  void NoteOff(int32_t channel_num, int32_t note_number);
+  void NoteOn(int32_t channel_num, int32_t part, int32_t note_number, int32_t velocity);
+  void ControlChange(int32_t channel_num, int32_t controller, int32_t value);
   void SystemExclusive(void);
   bool InitializeReverbBuffer(void);
   bool DeinitializeReverbBuffer(void);
+  bool InitializeWaveCache(void);
+  constexpr bool EMPTY_DeinitializeWaveCache(void);
+  void BuildWaveCache(void);
+  uint64_t GetRomChecksum(void) const;
+  bool MapWaveCacheFile(uint64_t rom_checksum);
+  void UnmapWaveCacheFile(void);
+  void WriteWaveCacheFile(uint64_t rom_checksum) const;
+  uint32_t DecodeWavePass(uint32_t position, uint32_t end, uint32_t loop_start, int32_t sample, uint32_t shift);
+  uint32_t AddFlagsRow(std::map<uint32_t, uint32_t>& rows, uint32_t offset);
+  uint32_t AddFlags2Row(std::map<uint32_t, uint32_t>& rows, uint32_t offset);
   void EnableReverb(void);
   void DisableReverb(void);
   void SetReverbShift(uint32_t shift);
-  void DefragmentVoices(void);
+  void ProcessReverb(int32_t* left, int32_t* right, uint32_t count, uint32_t shift);
+  void SwitchReverbPipeline(void);
+  void RunReverbPipeline(int32_t* left, int32_t* right, uint32_t count);
+  void ReverbWorker(void);
+  void MixVoiceBlock(int32_t* left, int32_t* right, uint32_t count, const int* range_start, const int* range_end, int range_count);
+  void MixVoiceShare(Voice_Thread_Data* thread_data, uint32_t count);
+  void VoiceWorker(int thread_index, uint32_t serial);
+  inline int GetVoiceThreadCount(void) const;
+  inline void AdvanceSampleClock(uint32_t frames);
+  inline int GetVoiceIndex(const Voice_Data* voice_data_ptr) const;
+  void CopyVoice(int dst_index, int src_index);
   void GenerateOutputData(uint8_t* output_ptr, uint32_t offset1, uint32_t offset2);
   inline void GenerateOutputDataVst(double** output_ptr, uint32_t offset1, uint32_t offset2); // invasive workaround
+  inline void WrapVoiceSamples(int first_index, int last_index, Voice_Thread_Data* thread_data);
+  void WrapVoiceSample(int index, Voice_Thread_Data* thread_data);
   bool InitializeMidiDataBuffer(void);
   bool EMPTY_DeinitializeMidiDataBuffer(void);
-  void AddByteToMidiDataBuffer(uint8_t value);
-  uint8_t GetValueFromMidiDataBuffer(void);
+  void AddByteToMidiEvent(uint8_t value);
+  void FlushMidiEvent(void);
+  bool PostMidiEvent(const Midi_Event* event);
+  void ProcessMidiEvents(uint32_t offset_limit);
+  inline void ProcessMidiByte(uint8_t midi_value);
+  void IngestMidiQueue(iplug::IMidiQueue& queue, int nFrames);
+  void SortMidiBatch(void);
+  void CoalesceMidiBatch(uint32_t first, uint32_t last);
   bool InitializePhase(void);
   bool EMPTY_DeinitializePhase(void);
   void voice_set_freq(Voice_Data* voice_data_ptr, int32_t pitch);
-  int32_t voice_get_index(Voice_Data* voice_data_ptr, int32_t pitch);
+  inline int32_t voice_get_freq_key(const Voice_Data* voice_data_ptr, int32_t pitch) const;
+  inline void voice_update_freq(Voice_Data* voice_data_ptr, int32_t pitch);
+  int32_t voice_get_note(const Voice_Data* voice_data_ptr) const;
+  inline const Note_Template* voice_get_template(const Voice_Data* voice_data_ptr) const;
   void ProgramChange(Program_Data* program_data_ptr, uint32_t program_number);
   void ReduceActiveVoices(int32_t maximum_voices);
   void VoiceSoundOff(Voice_Data* voice_data_ptr);
@@ -273,14 +628,18 @@ private:
   void ControllerSettingsOn(int32_t channel_num);
   void ControllerSettingsOff(int32_t channel_num);
   void StartPlayingVoice(Voice_Data* voice_data_ptr, Channel_Data* channel_data_ptr, Program_Data* program_data_ptr);
-  uint8_t* parseMidiMsg(iplug::IMidiMsg& msg);
   void voice_set_panpot(Voice_Data* voice_data_ptr);
   void voice_set_flags(Voice_Data* voice_data_ptr);
   void voice_set_flags2(Voice_Data* voice_data_ptr);
   void voice_set_amp(Voice_Data* voice_data_ptr);
+  inline void voice_update_amp(Voice_Data* voice_data_ptr);
   inline int32_t sub_C0036FB0(int16_t value3);
-  void sub_C0036FE0(void);
-  void sub_C0037140(void);
+  void sub_C0036FE0(uint32_t group_mask);
+  void sub_C0037140(uint32_t group_mask);
+  void UpdateVoiceEnvelope(int index);
+  bool InitializeVoicePool(void);
+  void DeinitializeVoicePool(void);
+  size_t LayoutVoicePool(uint8_t* base, int32_t capacity);
   bool InitializeStructures(void);
   bool EMPTY_DeinitializeStructures(void);
   void ResetAllControllers(Channel_Data* channel_data_ptr);